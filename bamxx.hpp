@@ -29,20 +29,254 @@
 #include <htslib/sam.h>
 #include <htslib/thread_pool.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
 #include <limits>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define BAMXX_X86_SIMD
+#include <immintrin.h>
+#endif
 
 namespace bamxx {
 
+// Decoding of 4-bit packed sequence into ASCII. The SSSE3 and AVX2 kernels
+// look up 16 or 32 nibbles at once with a byte shuffle against the 16
+// letters of seq_nt16_str; which kernel runs is decided once at run time.
+
+// `packed` starts at an even base; writes n chars and no terminator
+inline auto
+decode_seq_scalar(const uint8_t *packed, const size_t n, char *out) -> void {
+  for (size_t i = 0; i + 1 < n; i += 2) {
+    const uint8_t x = packed[i / 2];
+    out[i] = seq_nt16_str[x >> 4];
+    out[i + 1] = seq_nt16_str[x & 0xf];
+  }
+  if (n & 1) out[n - 1] = seq_nt16_str[packed[n / 2] >> 4];
+}
+
+#ifdef BAMXX_X86_SIMD
+__attribute__((target("ssse3"))) inline auto
+decode_seq_ssse3(const uint8_t *packed, const size_t n, char *out) -> void {
+  const __m128i lut = _mm_setr_epi8('=', 'A', 'C', 'M', 'G', 'R', 'S', 'V',
+                                    'T', 'W', 'Y', 'H', 'K', 'D', 'B', 'N');
+  const __m128i mask = _mm_set1_epi8(0xf);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m128i x =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(packed + i / 2));
+    const __m128i hi =
+      _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(x, 4), mask));
+    const __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(x, mask));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                     _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 16),
+                     _mm_unpackhi_epi8(hi, lo));
+  }
+  decode_seq_scalar(packed + i / 2, n - i, out + i);
+}
+
+__attribute__((target("avx2"))) inline auto
+decode_seq_avx2(const uint8_t *packed, const size_t n, char *out) -> void {
+  const __m256i lut = _mm256_setr_epi8(
+    '=', 'A', 'C', 'M', 'G', 'R', 'S', 'V', 'T', 'W', 'Y', 'H', 'K', 'D', 'B',
+    'N', '=', 'A', 'C', 'M', 'G', 'R', 'S', 'V', 'T', 'W', 'Y', 'H', 'K', 'D',
+    'B', 'N');
+  const __m256i mask = _mm256_set1_epi8(0xf);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    const __m256i x =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i *>(packed + i / 2));
+    const __m256i hi =
+      _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), mask));
+    const __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(x, mask));
+    // unpack works within 128-bit lanes, so put the lanes back in order
+    const __m256i a = _mm256_unpacklo_epi8(hi, lo);
+    const __m256i b = _mm256_unpackhi_epi8(hi, lo);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i),
+                        _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i + 32),
+                        _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  decode_seq_ssse3(packed + i / 2, n - i, out + i);
+}
+#endif
+
+// Writes bases [beg, beg + n) of a packed sequence to out as ASCII, without
+// a terminator
+inline auto
+decode_seq(const uint8_t *packed, size_t beg, size_t n, char *out) -> void {
+  using kernel = void (*)(const uint8_t *, const size_t, char *);
+  static const kernel decode = []() -> kernel {
+#ifdef BAMXX_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return decode_seq_avx2;
+    if (__builtin_cpu_supports("ssse3")) return decode_seq_ssse3;
+#endif
+    return decode_seq_scalar;
+  }();
+  if (n == 0) return;
+  if (beg & 1) {
+    *out++ = seq_nt16_str[packed[beg / 2] & 0xf];
+    ++beg;
+    --n;
+  }
+  decode(packed + beg / 2, n, out);
+}
+
+// Packs n ASCII bases into (n + 1) / 2 bytes; the inverse of decode_seq
+inline auto
+encode_seq(const char *seq, const size_t n, uint8_t *packed) -> void {
+  const auto code = [](const char c) {
+    return seq_nt16_table[static_cast<uint8_t>(c)];
+  };
+  for (size_t i = 0; i + 1 < n; i += 2)
+    packed[i / 2] = code(seq[i]) << 4 | code(seq[i + 1]);
+  if (n & 1) packed[n / 2] = code(seq[n - 1]) << 4;
+}
+
+// Reverse complement of packed sequence. In the 4-bit codes the complement
+// of a base is its bits in reverse order (A=0001 <-> T=1000), so reversing
+// a packed array is a byte reversal plus a per-byte map that complements
+// and swaps the two nibbles; the SSSE3 kernel does both with shuffles.
+inline auto
+revcomp_packed_byte(const uint8_t x) -> uint8_t {
+  static constexpr uint8_t comp[] = {0, 8, 4, 12, 2, 10, 6, 14,
+                                     1, 9, 5, 13, 3, 11, 7, 15};
+  return comp[x & 0xf] << 4 | comp[x >> 4];
+}
+
+template<bool complement>
+inline auto
+reverse_bytes_scalar(uint8_t *p, const size_t n) -> void {
+  std::reverse(p, p + n);
+  if (complement)
+    for (size_t i = 0; i < n; ++i) p[i] = revcomp_packed_byte(p[i]);
+}
+
+#ifdef BAMXX_X86_SIMD
+template<bool complement>
+__attribute__((target("ssse3"))) inline auto
+reverse_block_ssse3(__m128i x) -> __m128i {
+  const __m128i rev =
+    _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  x = _mm_shuffle_epi8(x, rev);
+  if (!complement) return x;
+  const __m128i comp_lo =
+    _mm_setr_epi8(0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15);
+  const __m128i comp_hi = _mm_slli_epi16(comp_lo, 4);  // no carry past 0xf0
+  const __m128i mask = _mm_set1_epi8(0xf);
+  const __m128i lo = _mm_and_si128(x, mask);
+  const __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+  return _mm_or_si128(_mm_shuffle_epi8(comp_hi, lo),
+                      _mm_shuffle_epi8(comp_lo, hi));
+}
+
+// Swaps 16-byte blocks from both ends inwards; the middle left over is
+// shorter than two blocks and done by the scalar version
+template<bool complement>
+__attribute__((target("ssse3"))) inline auto
+reverse_bytes_ssse3(uint8_t *p, const size_t n) -> void {
+  size_t i = 0, j = n;
+  for (; j - i >= 32; i += 16) {
+    j -= 16;
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + j));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p + i),
+                     reverse_block_ssse3<complement>(b));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p + j),
+                     reverse_block_ssse3<complement>(a));
+  }
+  reverse_bytes_scalar<complement>(p + i, j - i);
+}
+#endif
+
+template<bool complement>
+inline auto
+reverse_bytes(uint8_t *p, const size_t n) -> void {
+#ifdef BAMXX_X86_SIMD
+  static const bool ssse3 = (__builtin_cpu_init(),
+                             __builtin_cpu_supports("ssse3"));
+  if (ssse3) return reverse_bytes_ssse3<complement>(p, n);
+#endif
+  reverse_bytes_scalar<complement>(p, n);
+}
+
+// Reverse complements n bases of packed sequence in place
+inline auto
+revcomp_packed(uint8_t *packed, const size_t n) -> void {
+  const size_t n_bytes = (n + 1) / 2;
+  reverse_bytes<true>(packed, n_bytes);
+  if (n & 1) {  // the empty last nibble is now first: shift left by one
+    for (size_t i = 0; i + 1 < n_bytes; ++i)
+      packed[i] = packed[i] << 4 | packed[i + 1] >> 4;
+    packed[n_bytes - 1] <<= 4;
+  }
+}
+
+// Read-only view of n contiguous values, for pre-C++20 code
+template<typename T> struct bam_span {
+  auto begin() const -> const T * { return ptr; }
+  auto end() const -> const T * { return ptr + len; }
+  auto size() const -> size_t { return len; }
+  auto empty() const -> bool { return len == 0; }
+  auto operator[](const size_t i) const -> const T & { return ptr[i]; }
+
+  const T *ptr{};
+  size_t len{};
+};
+
+// Read-only view of a 4-bit packed sequence, two bases per byte
+struct bam_seq_view {
+  auto size() const -> size_t { return len; }
+  // 4-bit code of base i: 1=A, 2=C, 4=G, 8=T, 15=N
+  auto operator[](const size_t i) const -> uint8_t {
+    return bam_seqi(packed, i);
+  }
+  auto base(const size_t i) const -> char { return seq_nt16_str[(*this)[i]]; }
+
+  const uint8_t *packed{};
+  size_t len{};
+};
+
 struct bam_rec {
   bam_rec() = default;
 
-  bam_rec(const bam_rec &other): b{bam_copy1(bam_init1(), other.b)} {}
+  bam_rec(const bam_rec &other)
+      : b{other.b == nullptr ? nullptr : bam_copy1(bam_init1(), other.b)} {}
+
+  // Moving only transfers the bam1_t pointer, so containers of bam_rec
+  // can grow and sort without calling bam_copy1
+  bam_rec(bam_rec &&other) noexcept: b{other.b} { other.b = nullptr; }
 
-  auto operator=(bam_rec rhs) -> bam_rec & {
-    std::swap(b, rhs.b);
+  // by-value: copy-assign copies, move-assign only moves the pointer
+  auto operator=(bam_rec rhs) noexcept -> bam_rec & {
+    swap(rhs);
     return *this;
   }
 
@@ -50,14 +284,169 @@ struct bam_rec {
     if (b != nullptr) bam_destroy1(b);
   }
 
+  auto swap(bam_rec &rhs) noexcept -> void { std::swap(b, rhs.b); }
+
+  // Views into b->data without copying; each is only pointer arithmetic and
+  // stays valid until the record is modified or read into again
+  auto qname() const -> std::string_view {
+    return {bam_get_qname(b), b->core.l_qname - b->core.l_extranul - 1u};
+  }
+  auto cigar() const -> bam_span<uint32_t> {
+    return {bam_get_cigar(b), b->core.n_cigar};
+  }
+  auto seq() const -> bam_seq_view {
+    return {bam_get_seq(b), static_cast<size_t>(b->core.l_qseq)};
+  }
+  // Phred values without the +33; 0xff in the first value means absent
+  auto qual() const -> bam_span<uint8_t> {
+    return {bam_get_qual(b), static_cast<size_t>(b->core.l_qseq)};
+  }
+  // Reverse complements the sequence and reverses the qualities in place;
+  // the flag, position and CIGAR are not changed
+  auto revcomp_seq() -> void {
+    revcomp_packed(bam_get_seq(b), b->core.l_qseq);
+    reverse_bytes<false>(bam_get_qual(b), b->core.l_qseq);
+  }
+
+  // Type byte and value of an aux field, or nullptr if it is not present
+  auto aux(const char tag[2]) const -> const uint8_t * {
+    return bam_aux_get(b, tag);
+  }
+
   bam1_t *b{};
 };
 
+inline auto
+swap(bam_rec &a, bam_rec &b) noexcept -> void {
+  a.swap(b);
+}
+
+// A bam_rec_pool hands out records whose data blocks are carved from slabs
+// owned by the pool. These blocks are marked BAM_USER_DATA so htslib
+// never frees them; if a record outgrows its block, htslib gives it a
+// malloc'd buffer of its own. Records returned with put() keep their
+// buffers, so reading into recycled records does not allocate once the pool
+// is warm. Records obtained from a pool must not outlive it.
+struct bam_rec_pool {
+  explicit bam_rec_pool(const size_t block_size = 512,
+                        const size_t blocks_per_slab = 4096)
+      : block_size{(block_size + 7) & ~static_cast<size_t>(7)},
+        blocks_per_slab{blocks_per_slab} {}
+
+  bam_rec_pool(const bam_rec_pool &) = delete;
+  auto operator=(const bam_rec_pool &) -> bam_rec_pool & = delete;
+
+  auto get() -> bam_rec {
+    if (free_recs.empty()) return make_rec();
+    bam_rec r{std::move(free_recs.back())};
+    free_recs.pop_back();
+    return r;
+  }
+
+  auto put(bam_rec &&r) -> void {
+    if (r.b != nullptr) free_recs.emplace_back(std::move(r));
+  }
+
+  // recycle a whole batch at once; leaves `recs` empty
+  auto put(std::vector<bam_rec> &recs) -> void {
+    for (auto &r : recs) put(std::move(r));
+    recs.clear();
+  }
+
+  auto make_rec() -> bam_rec {
+    if (slabs.empty() || slab_used == blocks_per_slab) {
+      slabs.emplace_back(new uint8_t[block_size * blocks_per_slab]);
+      slab_used = 0;
+    }
+    bam_rec r;
+    r.b = bam_init1();
+    r.b->data = slabs.back().get() + block_size * slab_used++;
+    r.b->m_data = block_size;
+    bam_set_mempolicy(r.b, bam_get_mempolicy(r.b) | BAM_USER_DATA);
+    return r;
+  }
+
+  size_t block_size{};
+  size_t blocks_per_slab{};
+  size_t slab_used{};
+  std::vector<std::unique_ptr<uint8_t[]>> slabs;
+  std::vector<bam_rec> free_recs;
+};
+
+// Records overlapping a region, as returned by bam_in::query. Records can
+// be read into a bam_rec of the caller with read(), or by range-for, which
+// reuses the one bam_rec held here:
+//   for (auto &r : in.query(hdr, "chr1:1000-2000")) ...
+struct bam_itr {
+  bam_itr(samFile *f, hts_itr_t *itr): f{f}, itr{itr} {}
+
+  bam_itr(const bam_itr &) = delete;
+
+  bam_itr(bam_itr &&other) noexcept
+      : f{other.f}, itr{other.itr}, rec{std::move(other.rec)} {
+    other.itr = nullptr;
+  }
+
+  ~bam_itr() {
+    if (itr != nullptr) hts_itr_destroy(itr);
+  }
+
+  operator bool() const { return itr != nullptr; }
+
+  auto read(bam_rec &b) -> bool {
+    if (b.b == nullptr) b.b = bam_init1();
+    const int x = sam_itr_next(f, itr, b.b);  // -1 when region is done
+    if (x < -1) throw std::runtime_error("failed reading bam record");
+    return x >= 0;
+  }
+
+  struct iterator {
+    using iterator_category = std::input_iterator_tag;
+    using value_type = bam_rec;
+    using difference_type = std::ptrdiff_t;
+    using pointer = bam_rec *;
+    using reference = bam_rec &;
+
+    auto operator*() const -> bam_rec & { return q->rec; }
+    auto operator->() const -> bam_rec * { return &q->rec; }
+    auto operator++() -> iterator & {
+      if (!q->read(q->rec)) q = nullptr;
+      return *this;
+    }
+    auto operator==(const iterator &rhs) const -> bool { return q == rhs.q; }
+    auto operator!=(const iterator &rhs) const -> bool { return q != rhs.q; }
+
+    bam_itr *q{};
+  };
+
+  auto begin() -> iterator {
+    iterator it{itr == nullptr ? nullptr : this};
+    return it.q == nullptr ? it : ++it;
+  }
+
+  auto end() -> iterator { return iterator{}; }
+
+  samFile *f{};
+  hts_itr_t *itr{};
+  bam_rec rec;
+};
+
 struct bam_in {
-  explicit bam_in(const std::string &fn): f{hts_open(fn.c_str(), "r")} {}
+  // With mmap_input the file is mapped and htslib reads compressed blocks
+  // from memory, with no read() calls; if the file cannot be mapped, it is
+  // opened as usual
+  explicit bam_in(const std::string &fn, const bool mmap_input = false) {
+    if (mmap_input) open_mapped(fn);
+    if (f == nullptr) f = hts_open(fn.c_str(), "r");
+  }
 
   ~bam_in() {
-    if (f != nullptr) hts_close(f);
+    if (idx != nullptr) hts_idx_destroy(idx);
+    if (f != nullptr) {
+      release_mapped();
+      hts_close(f);
+    }
+    unmap();
   }
 
   operator bool() const { return f != nullptr; }
@@ -70,13 +459,92 @@ struct bam_in {
     return x >= 0;
   }
 
+  // Reads up to n records into the front of `batch` and returns how many
+  // were read; 0 means EOF. The batch only ever grows, so the bam1_t
+  // buffers in it are reused by later calls.
+  template<typename T>
+  auto read_batch(T &h, std::vector<bam_rec> &batch, const size_t n)
+    -> size_t {
+    if (batch.size() < n) batch.resize(n);
+    size_t i = 0;
+    for (; i < n; ++i) {
+      bam_rec &b = batch[i];
+      if (b.b == nullptr) b.b = bam_init1();
+      const int x = sam_read1(f, h.h, b.b);
+      if (x < -1) throw std::runtime_error("failed reading bam record");
+      if (x < 0) break;
+    }
+    return i;
+  }
+
+  // Loads the .bai/.csi index next to the file once; query() calls this
+  auto load_index() -> bool {
+    if (idx == nullptr) idx = sam_index_load(f, f->fn);
+    return idx != nullptr;
+  }
+
+  // Region string as in samtools, e.g. "chr1:1000-2000"; the returned
+  // bam_itr is false if the index or the region could not be loaded
+  template<typename T>
+  auto query(T &h, const std::string &region) -> bam_itr {
+    if (!load_index()) return bam_itr{f, nullptr};
+    return bam_itr{f, sam_itr_querys(idx, h.h, region.c_str())};
+  }
+
+  // Zero-based, half-open interval [beg, end) on target tid
+  auto query(const int32_t tid, const hts_pos_t beg, const hts_pos_t end)
+    -> bam_itr {
+    if (!load_index()) return bam_itr{f, nullptr};
+    return bam_itr{f, sam_itr_queryi(idx, tid, beg, end)};
+  }
+
   auto is_mapped_reads_file() const -> bool {
     const htsFormat *fmt = hts_get_format(f);
     return fmt->category == sequence_data &&
            (fmt->format == bam || fmt->format == sam);
   }
 
+  auto open_mapped(const std::string &fn) -> void {
+    const int fd = open(fn.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    struct stat st {};
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      map_size = st.st_size;
+      map = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) map = nullptr;
+    }
+    close(fd);
+    if (map == nullptr) return;
+    // readahead as pages are touched; MADV_WILLNEED on the whole mapping
+    // would read all of a large file into the page cache up front
+    madvise(map, map_size, MADV_SEQUENTIAL);
+    mem = hopen("mem:", "r:", static_cast<char *>(map), map_size);
+    if (mem != nullptr) f = hts_hopen(mem, fn.c_str(), "r");
+    if (f == nullptr && mem != nullptr) {
+      hFILE *hf = mem;
+      release_mapped();
+      hclose_abruptly(hf);
+    }
+    if (f == nullptr) unmap();
+  }
+
+  // The mem: hFILE frees its buffer on close, but the buffer is the mapping
+  auto release_mapped() -> void {
+    size_t len = 0;
+    if (mem != nullptr) hfile_mem_steal_buffer(mem, &len);
+    mem = nullptr;
+  }
+
+  auto unmap() -> void {
+    if (map != nullptr) munmap(map, map_size);
+    map = nullptr;
+  }
+
   samFile *f{};
+  hts_idx_t *idx{};
+  void *map{};
+  size_t map_size{};
+  hFILE *mem{};
 };
 
 struct bam_header {
@@ -94,13 +562,111 @@ struct bam_header {
 
   auto add_pg_line(const std::string &cmd, const std::string &id,
                    const std::string &vn) -> bool {
-    return sam_hdr_add_line(h, "PG", "ID", id.c_str(), "VN", vn.c_str(), "CL",
-                            cmd.c_str(), nullptr) == 0;
+    const bool ok = sam_hdr_add_line(h, "PG", "ID", id.c_str(), "VN",
+                                     vn.c_str(), "CL", cmd.c_str(),
+                                     nullptr) == 0;
+    // htslib may rebuild its target arrays; being non-const, this call
+    // cannot overlap the lookups, so the table is rebuilt here directly
+    if (!tid_table.empty()) index_targets();
+    return ok;
   }
 
   auto tostring() const -> std::string { return sam_hdr_str(h); }
 
+  // For BAM input, htslib reads the binary target list and keeps the SAM
+  // text unparsed until a sam_hdr_* line function needs it, at which point
+  // it builds records and hashes for every line, including each @SQ. The
+  // functions below scan the raw text instead, so @RG, @PG and @CO lines
+  // can be read without that cost. SAM input is parsed when it is read.
+  auto text() const -> std::string_view {
+    const char *s = sam_hdr_str(h);
+    return s == nullptr ? std::string_view{}
+                        : std::string_view(s, sam_hdr_length(h));
+  }
+
+  // Lines with record type `type` (e.g. "RG"), without the newline
+  auto lines(const std::string_view type) const
+    -> std::vector<std::string_view> {
+    std::vector<std::string_view> found;
+    const std::string_view t = text();
+    for (size_t i = 0; i < t.size();) {
+      size_t j = t.find('\n', i);
+      if (j == std::string_view::npos) j = t.size();
+      const std::string_view line = t.substr(i, j - i);
+      if (line.size() > type.size() && line[0] == '@' &&
+          line.substr(1, type.size()) == type &&
+          (line.size() == type.size() + 1 || line[type.size() + 1] == '\t'))
+        found.push_back(line);
+      i = j + 1;
+    }
+    return found;
+  }
+
+  // Value of `tag` (e.g. "ID") in a header line; empty if absent
+  static auto tag_value(const std::string_view line,
+                        const std::string_view tag) -> std::string_view {
+    for (size_t i = line.find('\t'); i != std::string_view::npos;) {
+      const size_t j = line.find('\t', i + 1);
+      const std::string_view field = line.substr(i + 1, j - i - 1);
+      if (field.size() > tag.size() && field.substr(0, tag.size()) == tag &&
+          field[tag.size()] == ':')
+        return field.substr(tag.size() + 1);
+      i = j;
+    }
+    return {};
+  }
+
+  // Target lookups. On first use these build a table of names and lengths
+  // and an open-addressing hash from name to tid, from the binary target
+  // list of the header, once even if called from many threads.
+  auto n_targets() const -> int32_t { return h->n_targets; }
+
+  auto name(const int32_t tid) const -> std::string_view {
+    std::call_once(targets_indexed, [this] { index_targets(); });
+    return names[tid];
+  }
+
+  auto length(const int32_t tid) const -> hts_pos_t {
+    std::call_once(targets_indexed, [this] { index_targets(); });
+    return lengths[tid];
+  }
+
+  // -1 if no target has this name
+  auto tid(const std::string_view name) const -> int32_t {
+    std::call_once(targets_indexed, [this] { index_targets(); });
+    const size_t mask = tid_table.size() - 1;
+    for (size_t i = hash_name(name) & mask;; i = (i + 1) & mask)
+      if (tid_table[i] < 0 || names[tid_table[i]] == name) return tid_table[i];
+  }
+
+  static auto hash_name(const std::string_view name) -> uint64_t {
+    uint64_t x = 0xcbf29ce484222325ull;  // FNV-1a
+    for (const auto c : name)
+      x = (x ^ static_cast<uint8_t>(c)) * 0x100000001b3ull;
+    return x;
+  }
+
+  auto index_targets() const -> void {
+    const int32_t n = h->n_targets;
+    names.resize(n);
+    lengths.resize(n);
+    size_t table_size = 2;
+    while (table_size < 2 * static_cast<size_t>(n)) table_size *= 2;
+    tid_table.assign(table_size, -1);
+    for (int32_t i = 0; i < n; ++i) {
+      names[i] = h->target_name[i];
+      lengths[i] = sam_hdr_tid2len(h, i);
+      size_t j = hash_name(names[i]) & (table_size - 1);
+      while (tid_table[j] >= 0) j = (j + 1) & (table_size - 1);
+      tid_table[j] = i;
+    }
+  }
+
   sam_hdr_t *h{};
+  mutable std::vector<std::string_view> names;
+  mutable std::vector<hts_pos_t> lengths;
+  mutable std::vector<int32_t> tid_table;
+  mutable std::once_flag targets_indexed;
 };
 
 struct bam_out {
@@ -108,7 +674,10 @@ struct bam_out {
       : f{hts_open(fn.c_str(), fmt ? "bw" : "w")} {}
 
   ~bam_out() {
-    if (f != nullptr) hts_close(f);
+    if (f != nullptr) {
+      save_index();
+      hts_close(f);
+    }
   }
 
   operator bool() const { return f != nullptr; }
@@ -119,14 +688,36 @@ struct bam_out {
 
   auto write(const bam_header &h) -> bool { return sam_hdr_write(f, h.h) == 0; }
 
+  // Call after writing the header of a coordinate-sorted BAM to index the
+  // records as they are written. The index goes to fn.bai, or to fn.csi if
+  // min_shift > 0, and is saved by save_index() or on destruction.
+  auto init_index(const bam_header &h, const int min_shift = 0) -> bool {
+    fnidx = std::string{f->fn} + (min_shift > 0 ? ".csi" : ".bai");
+    // fnidx must outlive the index: htslib keeps only the pointer
+    indexing = sam_idx_init(f, h.h, min_shift, fnidx.c_str()) == 0;
+    return indexing;
+  }
+
+  // Call after the last write; false if saving fails or not indexing
+  auto save_index() -> bool {
+    if (!indexing) return false;
+    indexing = false;
+    return sam_idx_save(f) == 0;
+  }
+
   htsFile *f{};
+  bool indexing{};
+  std::string fnidx;
 };
 
 struct bgzf_file {
   bgzf_file(const std::string &fn, const std::string &mode)
       : f{bgzf_open(fn.c_str(), mode.c_str())} {}
 
-  ~bgzf_file() { destroy(); }
+  ~bgzf_file() {
+    destroy();
+    if (buf.s != nullptr) free(buf.s);
+  }
 
   operator bool() const { return f != nullptr; }
 
@@ -152,30 +743,149 @@ struct bgzf_file {
   }
 
   BGZF *f{};
+  kstring_t buf{0, 0, nullptr};
 };
 
+// Both getline overloads read into the kstring_t kept in the
+// bgzf_file, so after the longest line has been seen no more allocation
+// happens. The string_view version points into that buffer and is only
+// valid until the next read from the same file.
 inline auto
-getline(bgzf_file &file, std::string &line) -> bgzf_file & {
+getline(bgzf_file &file, std::string_view &line) -> bgzf_file & {
   if (file.f == nullptr) return file;
-  kstring_t s{0, 0, nullptr};
-  const int x = bgzf_getline(file.f, '\n', &s);
+  const int x = bgzf_getline(file.f, '\n', &file.buf);
   if (x == -1) {
     file.destroy();
-    line.clear();
+    line = std::string_view{};
   }
-  else {
-    line.resize(s.l);
-    std::copy(s.s, s.s + s.l, std::begin(line));
-  }
-  if (s.s != nullptr) free(s.s);
+  else
+    line = std::string_view(file.buf.s, file.buf.l);
   return file;
 }
 
+inline auto
+getline(bgzf_file &file, std::string &line) -> bgzf_file & {
+  if (file.f == nullptr) return file;
+  std::string_view v;
+  getline(file, v);
+  line.assign(std::cbegin(v), std::cend(v));
+  return file;
+}
+
+// Splits whole decompressed BGZF blocks of a bgzf_file into lines, rather
+// than calling bgzf_getline once per line. Each call to read() consumes at
+// least one block and fills `lines` with views of the complete lines it
+// holds; the newline scan is memchr, which glibc vectorizes. A line that
+// spans blocks is joined in a buffer owned by the reader. The views are
+// valid until the next call, and getline should not be mixed with a reader
+// on the same file.
+struct bgzf_line_reader {
+  explicit bgzf_line_reader(bgzf_file &file): file{file} {}
+
+  auto read(std::vector<std::string_view> &lines) -> bool {
+    lines.clear();
+    while (lines.empty()) {
+      BGZF *const f = file.f;
+      if (f == nullptr) return false;
+      if (f->block_offset >= f->block_length) {
+        if (bgzf_read_block(f) != 0)
+          throw std::runtime_error("failed reading bgzf block");
+        if (f->block_length == 0) {  // EOF; last line may lack a newline
+          file.destroy();
+          if (partial.empty()) return false;
+          joined.assign(partial);
+          partial.clear();
+          lines.emplace_back(joined);
+          return true;
+        }
+      }
+      const char *beg =
+        static_cast<const char *>(f->uncompressed_block) + f->block_offset;
+      const char *const end =
+        static_cast<const char *>(f->uncompressed_block) + f->block_length;
+      f->block_offset = f->block_length = 0;  // whole block consumed
+
+      const char *nl = find_newline(beg, end);
+      if (nl == end) {  // no line ends in this block
+        partial.append(beg, end);
+        continue;
+      }
+      if (!partial.empty()) {
+        joined.assign(partial).append(beg, nl);
+        partial.clear();
+        lines.emplace_back(joined);
+        beg = nl + 1;
+        nl = find_newline(beg, end);
+      }
+      for (; nl != end; nl = find_newline(beg, end)) {
+        lines.emplace_back(beg, nl - beg);
+        beg = nl + 1;
+      }
+      partial.assign(beg, end);
+    }
+    return true;
+  }
+
+  static auto
+  find_newline(const char *beg, const char *end) -> const char * {
+    const void *nl = std::memchr(beg, '\n', end - beg);
+    return nl == nullptr ? end : static_cast<const char *>(nl);
+  }
+
+  bgzf_file &file;
+  std::string partial;
+  std::string joined;
+};
+
+// Counters for the compute tasks of a bam_tpool. htslib does not report
+// on its own BGZF jobs, so their share of worker time is included in what
+// looks idle here.
+struct bam_tpool_stats {
+  int n_threads{};
+  uint64_t queued{};         // tasks dispatched
+  uint64_t completed{};      // tasks finished
+  uint64_t max_in_flight{};  // most tasks queued or running at once
+  double busy_seconds{};     // time spent running tasks, over all workers
+  double wall_seconds{};     // since the pool was created
+
+  // Fraction of all worker time not spent in dispatched tasks; a pool busy
+  // only with decompression reads near 1, so this is not worker idleness
+  auto task_idle_fraction() const -> double {
+    const double total = wall_seconds * n_threads;
+    return total > 0.0 ? std::max(0.0, 1.0 - busy_seconds / total) : 1.0;
+  }
+
+  auto tostring() const -> std::string {
+    return "threads=" + std::to_string(n_threads) +
+           " queued=" + std::to_string(queued) +
+           " completed=" + std::to_string(completed) +
+           " max_in_flight=" + std::to_string(max_in_flight) +
+           " busy_s=" + std::to_string(busy_seconds) +
+           " wall_s=" + std::to_string(wall_seconds) +
+           " task_idle=" + std::to_string(task_idle_fraction());
+  }
+};
+
+// One pool of worker threads for any number of files and for compute
+// tasks. Each file given to set_io, and the compute tasks as a whole, get
+// their own htslib process queue of depth qsize (0: twice the number of
+// threads), and the workers take jobs from these queues in turn, so no one
+// file can starve the others. Files must be closed before the pool is
+// destroyed.
 struct bam_tpool {
-  explicit bam_tpool(const int n_threads)
-      : tpool{hts_tpool_init(n_threads), 0} {}
+  explicit bam_tpool(const int n_threads, const int qsize = 0)
+      : tpool{hts_tpool_init(n_threads), qsize} {}
 
-  ~bam_tpool() { hts_tpool_destroy(tpool.pool); }
+  bam_tpool(const bam_tpool &) = delete;
+  auto operator=(const bam_tpool &) -> bam_tpool & = delete;
+
+  ~bam_tpool() {
+    if (hts_tpool_process *const q = tasks.load(); q != nullptr) {
+      hts_tpool_process_flush(q);
+      hts_tpool_process_destroy(q);
+    }
+    hts_tpool_destroy(tpool.pool);
+  }
 
   template<class T> auto set_io(const T &bam_file) -> void {
     const int ret = hts_set_thread_pool(bam_file.f, &tpool);
@@ -188,7 +898,1110 @@ struct bam_tpool {
     if (ret < 0) throw std::runtime_error("failed to set thread pool");
   }
 
+  // Queues f() to run on the pool's workers alongside file (de)compression;
+  // blocks while the task queue is full. f may be move-only, and any thread
+  // may dispatch. A task must not wait on a file given to set_io on this
+  // pool, e.g. by reading a bam_in: it holds a worker while that file's
+  // blocks wait for one, so with as many such tasks as threads the pool
+  // deadlocks. Read in the dispatching thread and pass records to tasks.
+  template<typename F> auto dispatch(F f) -> void {
+    std::call_once(tasks_init, [this] {
+      const int n = tpool.qsize > 0 ? tpool.qsize
+                                     : 2 * hts_tpool_size(tpool.pool);
+      hts_tpool_process *const q =
+        hts_tpool_process_init(tpool.pool, n, 1);  // no results
+      if (q == nullptr)  // leaves tasks_init unset, so a later call retries
+        throw std::runtime_error("failed to create task queue");
+      tasks = q;
+    });
+    std::unique_ptr<task> job = std::make_unique<task_of<F>>(std::move(f));
+    job->pool = this;
+    const uint64_t in_flight = ++n_queued - n_completed;
+    uint64_t prev = max_in_flight;
+    while (prev < in_flight &&
+           !max_in_flight.compare_exchange_weak(prev, in_flight)) {}
+    hts_tpool_process *const q = tasks.load();
+    if (hts_tpool_dispatch(tpool.pool, q, run_task, job.get()) < 0) {
+      --n_queued;
+      throw std::runtime_error("failed to dispatch task");
+    }
+    job.release();  // now owned by run_task
+  }
+
+  auto stats() const -> bam_tpool_stats {
+    bam_tpool_stats s;
+    s.n_threads = hts_tpool_size(tpool.pool);
+    s.queued = n_queued;
+    s.completed = n_completed;
+    s.max_in_flight = max_in_flight;
+    s.busy_seconds = busy_ns * 1e-9;
+    const std::chrono::duration<double> wall = clock::now() - start;
+    s.wall_seconds = wall.count();
+    return s;
+  }
+
+  // Waits for all dispatched tasks; rethrows the first exception of any
+  auto wait() -> void {
+    hts_tpool_process *const q = tasks.load();  // may be set by dispatch
+    if (q != nullptr && hts_tpool_process_flush(q) < 0)
+      throw std::runtime_error("failed to flush task queue");
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (error) std::rethrow_exception(std::exchange(error, nullptr));
+  }
+
+  // Type-erased holder for a dispatched callable, which unlike
+  // std::function need not be copyable
+  struct task {
+    virtual ~task() = default;
+    virtual auto run() -> void = 0;
+    bam_tpool *pool{};
+  };
+
+  template<typename F> struct task_of : task {
+    explicit task_of(F &&f): f{std::move(f)} {}
+    auto run() -> void override { f(); }
+    F f;
+  };
+
+  static auto run_task(void *arg) -> void * {
+    const std::unique_ptr<task> job(static_cast<task *>(arg));
+    bam_tpool &p = *job->pool;
+    const auto t = clock::now();
+    try {
+      job->run();
+    }
+    catch (...) {  // an exception must not cross the htslib worker
+      std::lock_guard<std::mutex> lock(p.error_mutex);
+      if (!p.error) p.error = std::current_exception();
+    }
+    p.busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   clock::now() - t)
+                   .count();
+    ++p.n_completed;
+    return nullptr;
+  }
+
+  using clock = std::chrono::steady_clock;
+
   htsThreadPool tpool{};
+  std::atomic<hts_tpool_process *> tasks{nullptr};
+  std::once_flag tasks_init;
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  clock::time_point start{clock::now()};
+  std::atomic<uint64_t> n_queued{0};
+  std::atomic<uint64_t> n_completed{0};
+  std::atomic<uint64_t> max_in_flight{0};
+  std::atomic<uint64_t> busy_ns{0};
+};
+
+// Calls report(pool.stats()) every `interval` on a thread of its own, and
+// once more when destroyed
+struct bam_tpool_reporter {
+  bam_tpool_reporter(const bam_tpool &pool,
+                     const std::chrono::milliseconds interval,
+                     std::function<void(const bam_tpool_stats &)> report)
+      : pool{pool}, interval{interval}, report{std::move(report)},
+        reporter{[this] { run(); }} {}
+
+  bam_tpool_reporter(const bam_tpool_reporter &) = delete;
+  auto operator=(const bam_tpool_reporter &) -> bam_tpool_reporter & = delete;
+
+  ~bam_tpool_reporter() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      done = true;
+    }
+    cv.notify_one();
+    reporter.join();
+  }
+
+  auto run() -> void {
+    std::unique_lock<std::mutex> lock(m);
+    while (!cv.wait_for(lock, interval, [this] { return done; }))
+      report(pool.stats());
+    report(pool.stats());
+  }
+
+  const bam_tpool &pool;
+  std::chrono::milliseconds interval;
+  std::function<void(const bam_tpool_stats &)> report;
+  std::mutex m;
+  std::condition_variable cv;
+  bool done{};
+  std::thread reporter;  // last, so it starts after the other members
+};
+
+// Lets many threads hand batches of records to a single writer thread that
+// owns the bam_out. Batches are numbered 0, 1, 2, ... with no gaps and are
+// written in that order whatever order they arrive in. Each ring slot is
+// owned by one sequence number at a time, so batches are handed over
+// without a lock; the mutex only lets the writer sleep while its next slot
+// is empty, and a producer sleep while its batch is `capacity` or more
+// ahead of the writer. Call finish() after all push() calls have returned.
+// If a number is never pushed, as when a producer throws before pushing,
+// nothing after it can be written: finish() then returns false, and any
+// producer still waiting for room is woken and gets false from push().
+struct bam_writer_queue {
+  bam_writer_queue(bam_out &out, const bam_header &hdr,
+                   const size_t capacity = 64)
+      : out{out}, hdr{hdr}, slots(std::max<size_t>(1, capacity)),
+        writer{[this] { run(); }} {}
+
+  bam_writer_queue(const bam_writer_queue &) = delete;
+  auto operator=(const bam_writer_queue &) -> bam_writer_queue & = delete;
+
+  ~bam_writer_queue() { finish(); }
+
+  // False if the queue was closed while waiting for room; the batch is
+  // then not written
+  auto push(const uint64_t seq, std::vector<bam_rec> &&batch) -> bool {
+    if (seq >= next.load(std::memory_order_acquire) + slots.size()) {
+      std::unique_lock<std::mutex> lock(m);
+      ++n_waiting;
+      drained.wait(lock, [&] {
+        return closed ||
+               seq < next.load(std::memory_order_acquire) + slots.size();
+      });
+      --n_waiting;
+      if (closed) {
+        drained.notify_all();  // finish() waits for the last of these
+        return false;
+      }
+    }
+    slot &s = slots[seq % slots.size()];
+    s.batch = std::move(batch);
+    s.ready.store(seq + 1, std::memory_order_release);
+    { std::lock_guard<std::mutex> lock(m); }  // writer is waiting or awake
+    filled.notify_one();
+    return true;
+  }
+
+  // Waits until every batch has been written; false if any write failed or
+  // any batch could not be written
+  auto finish() -> bool {
+    if (writer.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(m);
+        closing = true;
+      }
+      filled.notify_one();
+      writer.join();
+      std::unique_lock<std::mutex> lock(m);
+      if (n_waiting > 0) good = false;
+      drained.wait(lock, [&] { return n_waiting == 0; });
+    }
+    return good;
+  }
+
+  auto run() -> void {
+    for (uint64_t seq = 0;; ++seq) {
+      slot &s = slots[seq % slots.size()];
+      const auto is_ready = [&] {
+        return s.ready.load(std::memory_order_acquire) == seq + 1;
+      };
+      if (!is_ready()) {
+        std::unique_lock<std::mutex> lock(m);
+        filled.wait(lock, [&] { return is_ready() || closing; });
+        if (!is_ready()) {  // closing, and seq will never arrive
+          for (const auto &t : slots)  // batches stranded after the gap
+            if (t.ready.load(std::memory_order_acquire) != 0) good = false;
+          closed = true;
+          drained.notify_all();
+          return;
+        }
+      }
+      for (const auto &r : s.batch) good = good && out.write(hdr, r);
+      s.batch.clear();
+      s.ready.store(0, std::memory_order_relaxed);
+      next.store(seq + 1, std::memory_order_release);
+      { std::lock_guard<std::mutex> lock(m); }
+      drained.notify_all();
+    }
+  }
+
+  struct slot {
+    std::atomic<uint64_t> ready{0};  // seq + 1 once the batch is in place
+    std::vector<bam_rec> batch;
+  };
+
+  bam_out &out;
+  const bam_header &hdr;
+  std::vector<slot> slots;
+  std::atomic<uint64_t> next{0};  // next sequence number to write
+  std::mutex m;
+  std::condition_variable filled;   // a slot became ready, or closing
+  std::condition_variable drained;  // next advanced, or closed
+  bool closing{};                   // finish() called; guarded by m
+  bool closed{};                    // writer stopped; guarded by m
+  uint32_t n_waiting{};             // producers waiting for room; guarded by m
+  bool good{true};
+  std::thread writer;  // last, so it starts after the other members
+};
+
+// Order of samtools sort: by target, with unmapped reads (tid -1) last,
+// then by position and then strand
+struct bam_less_coordinate {
+  auto operator()(const bam_rec &a, const bam_rec &b) const -> bool {
+    const uint32_t a_tid = a.b->core.tid, b_tid = b.b->core.tid;
+    if (a_tid != b_tid) return a_tid < b_tid;
+    if (a.b->core.pos != b.b->core.pos) return a.b->core.pos < b.b->core.pos;
+    return bam_is_rev(a.b) < bam_is_rev(b.b);
+  }
+};
+
+// Natural order of read names as in samtools sort -n: runs of digits
+// compare as numbers, ignoring leading zeros, and other characters as bytes
+inline auto
+natural_name_cmp(const char *a, const char *b) -> int {
+  const auto digit = [](const char c) { return c >= '0' && c <= '9'; };
+  while (*a != '\0' && *b != '\0') {
+    if (!digit(*a) || !digit(*b)) {
+      if (*a != *b) return static_cast<uint8_t>(*a) - static_cast<uint8_t>(*b);
+      ++a, ++b;
+      continue;
+    }
+    while (*a == '0') ++a;
+    while (*b == '0') ++b;
+    while (digit(*a) && *a == *b) ++a, ++b;
+    const int diff = static_cast<uint8_t>(*a) - static_cast<uint8_t>(*b);
+    while (digit(*a) && digit(*b)) ++a, ++b;
+    if (digit(*a)) return 1;  // more digits, so a larger number
+    if (digit(*b)) return -1;
+    if (diff != 0) return diff;
+  }
+  return *a != '\0' ? 1 : (*b != '\0' ? -1 : 0);
+}
+
+// By read name in natural order, then read1 before read2
+struct bam_less_queryname {
+  auto operator()(const bam_rec &a, const bam_rec &b) const -> bool {
+    const int x = natural_name_cmp(bam_get_qname(a.b), bam_get_qname(b.b));
+    if (x != 0) return x < 0;
+    const uint16_t mask = BAM_FREAD1 | BAM_FREAD2;
+    return (a.b->core.flag & mask) < (b.b->core.flag & mask);
+  }
+};
+
+// Stable sort of `recs`: n_threads parts are sorted concurrently and then
+// merged pairwise
+template<typename Less>
+auto
+sort_records(std::vector<bam_rec> &recs, const Less less,
+             const size_t n_threads) -> void {
+  const size_t n_parts = std::max<size_t>(1, std::min(n_threads, recs.size()));
+  std::vector<size_t> bounds;
+  for (size_t i = 0; i <= n_parts; ++i)
+    bounds.push_back(recs.size() * i / n_parts);
+  const auto part = [&](const size_t i) {
+    return std::begin(recs) + bounds[i];
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < n_parts; ++i)
+    threads.emplace_back(
+      [&, i] { std::stable_sort(part(i), part(i + 1), less); });
+  std::stable_sort(part(0), part(1), less);
+  for (auto &t : threads) t.join();
+
+  for (size_t w = 1; w < n_parts; w *= 2)
+    for (size_t i = 0; i + w < n_parts; i += 2 * w)
+      std::inplace_merge(part(i), part(i + w),
+                         part(std::min(i + 2 * w, n_parts)), less);
+}
+
+struct bam_sort_config {
+  size_t max_mem{768ul << 20};  // bytes of records held before a spill
+  size_t n_threads{1};          // for sorting and for BGZF (de)compression
+  bool by_name{};               // queryname rather than coordinate order
+  std::string tmp_prefix;       // temporary runs; out_fn if empty
+};
+
+// Sorts in_fn into the BAM file out_fn, holding at most about max_mem bytes
+// of records. Each time that fills, the records are sorted and written as a
+// temporary BAM run; the runs are then merged with a heap. Temporary runs
+// are removed even if an exception is thrown.
+template<typename Less>
+auto
+sort_bam(const std::string &in_fn, const std::string &out_fn,
+         const bam_sort_config &cfg, const Less less) -> bool {
+  struct tmp_files {
+    ~tmp_files() {
+      for (const auto &fn : names) std::remove(fn.c_str());
+    }
+    std::vector<std::string> names;
+  } runs;
+
+  bam_tpool tp(std::max<size_t>(1, cfg.n_threads));
+  bam_in in(in_fn);
+  if (!in) return false;
+  tp.set_io(in);
+  bam_header hdr(in);
+  if (!hdr) return false;
+  if (sam_hdr_change_HD(hdr.h, "SO", cfg.by_name ? "queryname" : "coordinate"))
+    return false;
+  // SS as samtools writes it; a stale sub-sort from the input is removed
+  if (cfg.by_name ? sam_hdr_change_HD(hdr.h, "SS", "queryname:natural") != 0
+                  : sam_hdr_remove_tag_hd(hdr.h, "SS") < 0)
+    return false;
+
+  const auto write_all = [&](const std::string &fn,
+                             const std::vector<bam_rec> &recs) {
+    bam_out out(fn, true);
+    if (!out) return false;
+    tp.set_io(out);
+    if (!out.write(hdr)) return false;
+    for (const auto &r : recs)
+      if (!out.write(hdr, r)) return false;
+    return true;
+  };
+
+  {
+    const std::string prefix =
+      cfg.tmp_prefix.empty() ? out_fn : cfg.tmp_prefix;
+    bam_rec_pool pool;
+    std::vector<bam_rec> buf;
+    size_t mem = 0;
+    for (bam_rec r = pool.get(); in.read(hdr, r); r = pool.get()) {
+      mem += sizeof(bam_rec) + sizeof(bam1_t) + r.b->m_data;
+      buf.push_back(std::move(r));
+      if (mem >= cfg.max_mem) {
+        sort_records(buf, less, cfg.n_threads);
+        runs.names.push_back(prefix + ".tmp." +
+                             std::to_string(runs.names.size()) + ".bam");
+        if (!write_all(runs.names.back(), buf)) return false;
+        pool.put(buf);
+        mem = 0;
+      }
+    }
+    if (runs.names.empty() || !buf.empty())
+      sort_records(buf, less, cfg.n_threads);
+    if (runs.names.empty()) return write_all(out_fn, buf);
+    if (!buf.empty()) {
+      runs.names.push_back(prefix + ".tmp." +
+                           std::to_string(runs.names.size()) + ".bam");
+      if (!write_all(runs.names.back(), buf)) return false;
+    }
+  }
+
+  // k-way merge; ties go to the earlier run so the sort stays stable
+  struct run_head {
+    bam_rec r;
+    size_t run{};
+  };
+  const auto later = [&less](const run_head &x, const run_head &y) {
+    return less(y.r, x.r) || (!less(x.r, y.r) && x.run > y.run);
+  };
+  std::vector<std::unique_ptr<bam_in>> ins;
+  std::vector<run_head> heap;
+  for (const auto &fn : runs.names) {
+    ins.emplace_back(new bam_in(fn));
+    if (!*ins.back()) return false;
+    tp.set_io(*ins.back());
+    if (!bam_header(*ins.back())) return false;  // skip the run header
+    run_head h{bam_rec{}, ins.size() - 1};
+    if (ins.back()->read(hdr, h.r)) heap.push_back(std::move(h));
+  }
+  std::make_heap(std::begin(heap), std::end(heap), later);
+
+  bam_out out(out_fn, true);
+  if (!out) return false;
+  tp.set_io(out);
+  if (!out.write(hdr)) return false;
+  while (!heap.empty()) {
+    std::pop_heap(std::begin(heap), std::end(heap), later);
+    run_head &h = heap.back();
+    if (!out.write(hdr, h.r)) return false;
+    if (ins[h.run]->read(hdr, h.r))
+      std::push_heap(std::begin(heap), std::end(heap), later);
+    else
+      heap.pop_back();
+  }
+  return true;
+}
+
+inline auto
+sort_bam(const std::string &in_fn, const std::string &out_fn,
+         const bam_sort_config &cfg) -> bool {
+  return cfg.by_name ? sort_bam(in_fn, out_fn, cfg, bam_less_queryname{})
+                     : sort_bam(in_fn, out_fn, cfg, bam_less_coordinate{});
+}
+
+// Zero-based, half-open interval [beg, end) on target tid
+struct bam_shard {
+  int32_t tid{};
+  hts_pos_t beg{};
+  hts_pos_t end{};
+};
+
+// Virtual file offsets of the first chunk start and the last chunk end in
+// the index for records overlapping [beg, end) on tid; {0, 0} if there are
+// none. A virtual offset is the file offset of a BGZF block shifted left
+// 16 bits plus the offset in the block, so differences between them order
+// like compressed bytes.
+inline auto
+index_span(const hts_idx_t *idx, const int32_t tid, const hts_pos_t beg,
+           const hts_pos_t end) -> std::pair<uint64_t, uint64_t> {
+  std::pair<uint64_t, uint64_t> span{};
+  hts_itr_t *itr = sam_itr_queryi(idx, tid, beg, end);
+  if (itr == nullptr) return span;
+  if (itr->n_off > 0) span.first = itr->off[0].u;  // sorted by start
+  for (int i = 0; i < itr->n_off; ++i)
+    span.second = std::max(span.second, itr->off[i].v);
+  hts_itr_destroy(itr);
+  return span;
+}
+
+// Splits all targets into roughly n_shards intervals of similar work. The
+// targets are cut into windows of at least 16 kb, about 64 per shard, and
+// each shard is a run of windows on one target. If an index loads, the
+// work of a window is the span of file offsets from where its records
+// start to where those of the next window start, so dense regions get
+// short shards; otherwise it is the window length. Targets with no records
+// get a single shard.
+inline auto
+make_shards(bam_in &in, const bam_header &hdr, const size_t n_shards)
+  -> std::vector<bam_shard> {
+  const int32_t n_targets = sam_hdr_nref(hdr.h);
+  const uint64_t n_wanted = std::max<size_t>(1, n_shards);
+  uint64_t genome_len{};
+  for (int32_t i = 0; i < n_targets; ++i)
+    genome_len += sam_hdr_tid2len(hdr.h, i);
+  const hts_pos_t step =
+    std::max<uint64_t>(16384, genome_len / (64 * n_wanted));
+  const bool use_index = in.load_index();
+
+  std::vector<bam_shard> windows;
+  std::vector<uint64_t> work;
+  std::vector<uint64_t> off;
+  for (int32_t i = 0; i < n_targets; ++i) {
+    const hts_pos_t len = sam_hdr_tid2len(hdr.h, i);
+    const size_t first = windows.size();
+    for (hts_pos_t beg = 0; beg < len; beg += step)
+      windows.push_back({i, beg, std::min(beg + step, len)});
+    if (!use_index) {
+      for (size_t j = first; j < windows.size(); ++j)
+        work.push_back(windows[j].end - windows[j].beg);
+      continue;
+    }
+    // off[k] is where the records of window k start, and the last entry is
+    // where those of the target end; a window with no records of its own
+    // takes the offset of the next, so it gets no work
+    const uint64_t target_end = index_span(in.idx, i, 0, len).second;
+    off.assign(windows.size() - first + 1, target_end);
+    for (size_t k = 0; k + 1 < off.size(); ++k) {
+      const bam_shard &w = windows[first + k];
+      off[k] = index_span(in.idx, i, w.beg, w.end).first;
+    }
+    for (size_t k = off.size() - 1; k-- > 0;)
+      if (off[k] == 0 || off[k] > off[k + 1]) off[k] = off[k + 1];
+    for (size_t k = 0; k + 1 < off.size(); ++k)
+      work.push_back(off[k + 1] - off[k]);
+  }
+  uint64_t total{};
+  for (const auto w : work) total += w;
+  const uint64_t per_shard = std::max<uint64_t>(1, total / n_wanted);
+
+  std::vector<bam_shard> shards;
+  uint64_t shard_work{};
+  for (size_t j = 0; j < windows.size(); ++j) {
+    const bam_shard &w = windows[j];
+    // cut before this window if that is closer to per_shard than after it
+    if (w.beg == 0 ||
+        (shard_work > 0 && shard_work + work[j] / 2 >= per_shard)) {
+      shards.push_back(w);
+      shard_work = 0;
+    }
+    shards.back().end = w.end;
+    shard_work += work[j];
+  }
+  return shards;
+}
+
+// Runs f(hdr, shard, itr) for every shard on n_threads threads, each with
+// its own bam_in and bam_header for `fn`, and returns the results in the
+// order of `shards`. The bam_itr covers the records overlapping the shard,
+// so a record spanning a boundary is seen by both shards; keep only those
+// with r.b->core.pos >= shard.beg to see each record once. The result type
+// must be default constructible. An exception from any worker is rethrown
+// here after all threads finish.
+template<typename F>
+using shard_result_t =
+  std::invoke_result_t<F &, bam_header &, const bam_shard &, bam_itr &>;
+
+template<typename F>
+auto
+process_shards(const std::string &fn, const std::vector<bam_shard> &shards,
+               const size_t n_threads, F f) -> std::vector<shard_result_t<F>> {
+  // workers assign results concurrently, so no packed std::vector<bool>
+  static_assert(!std::is_same_v<shard_result_t<F>, bool>,
+                "process_shards: return e.g. char or int rather than bool");
+  std::vector<shard_result_t<F>> results(shards.size());
+  std::atomic<size_t> next_shard{0};
+  std::vector<std::exception_ptr> errors(std::max<size_t>(1, n_threads));
+
+  const auto worker = [&](const size_t id) {
+    try {
+      bam_in in(fn);
+      if (!in) throw std::runtime_error("failed to open: " + fn);
+      bam_header hdr(in);
+      if (!hdr) throw std::runtime_error("failed to read header: " + fn);
+      if (!in.load_index())
+        throw std::runtime_error("failed to load index: " + fn);
+      for (size_t i = next_shard++; i < shards.size(); i = next_shard++) {
+        auto itr = in.query(shards[i].tid, shards[i].beg, shards[i].end);
+        if (!itr) throw std::runtime_error("failed to query: " + fn);
+        results[i] = f(hdr, shards[i], itr);
+      }
+    }
+    catch (...) {
+      errors[id] = std::current_exception();
+      next_shard = shards.size();  // stop the other workers early
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < errors.size(); ++i) threads.emplace_back(worker, i);
+  worker(0);
+  for (auto &t : threads) t.join();
+  for (const auto &e : errors)
+    if (e) std::rethrow_exception(e);
+  return results;
+}
+
+// Counts bisulfite conversion at CpG sites for n aligned bases; `ref`,
+// `read`, `meth` and `unmeth` all start at the first of them, and ref[nbr]
+// is the other base of a CpG at ref[0]. The read must be uppercase.
+inline auto
+count_cpg_block(const char *ref, const char *read, const int nbr,
+                const char target, const char converted, const size_t n,
+                uint32_t *meth, uint32_t *unmeth) -> void {
+  size_t i = 0;
+#ifdef BAMXX_X86_SIMD
+  const __m128i upper = _mm_set1_epi8(static_cast<char>(0xdf));
+  const __m128i t = _mm_set1_epi8(target);
+  const __m128i p = _mm_set1_epi8(target == 'C' ? 'G' : 'C');
+  const __m128i c = _mm_set1_epi8(converted);
+  for (; i + 16 <= n; i += 16) {
+    const auto load = [](const char *p) {
+      return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    };
+    const __m128i cpg = _mm_and_si128(
+      _mm_cmpeq_epi8(_mm_and_si128(load(ref + i), upper), t),
+      _mm_cmpeq_epi8(_mm_and_si128(load(ref + i + nbr), upper), p));
+    const __m128i r = load(read + i);
+    uint32_t m = _mm_movemask_epi8(_mm_and_si128(cpg, _mm_cmpeq_epi8(r, t)));
+    uint32_t u = _mm_movemask_epi8(_mm_and_si128(cpg, _mm_cmpeq_epi8(r, c)));
+    for (; m != 0; m &= m - 1) ++meth[i + __builtin_ctz(m)];
+    for (; u != 0; u &= u - 1) ++unmeth[i + __builtin_ctz(u)];
+  }
+#endif
+  const char partner = target == 'C' ? 'G' : 'C';
+  for (; i < n; ++i)
+    if ((ref[i] & 0xdf) == target && (ref[i + nbr] & 0xdf) == partner) {
+      meth[i] += read[i] == target;
+      unmeth[i] += read[i] == converted;
+    }
+}
+
+// For a read aligned within the reference slice ref[0, ref_end - ref_beg),
+// holding positions [ref_beg, ref_end), adds the read's bases at CpG sites
+// to meth and unmeth, which are indexed like ref. With ga false this counts
+// C (methylated) and T (converted) at the C of each CpG; with ga true it
+// counts G and A at the G, as for reads from the opposite strand. Only
+// aligned bases count. `buf` holds the decoded read between calls.
+inline auto
+count_cpg_conversions(const bam_rec &r, const bool ga, const char *ref,
+                      const hts_pos_t ref_beg, const hts_pos_t ref_end,
+                      uint32_t *meth, uint32_t *unmeth, std::string &buf)
+  -> void {
+  const auto seq = r.seq();
+  buf.resize(seq.size());
+  decode_seq(seq.packed, 0, seq.size(), &buf[0]);
+
+  const char target = ga ? 'G' : 'C';
+  const char converted = ga ? 'A' : 'T';
+  const int nbr = ga ? -1 : 1;  // offset of the other base of the CpG
+  // positions whose neighbor is also inside the slice
+  const hts_pos_t lo = ref_beg + (ga ? 1 : 0);
+  const hts_pos_t hi = ref_end - (ga ? 0 : 1);
+
+  hts_pos_t rpos = r.b->core.pos;
+  hts_pos_t qpos = 0;
+  for (const auto c : r.cigar()) {
+    const uint32_t op = bam_cigar_op(c);
+    const hts_pos_t len = bam_cigar_oplen(c);
+    const int type = bam_cigar_type(op);  // 1: query, 2: reference
+    if (type == 3) {
+      const hts_pos_t beg = std::max(rpos, lo), end = std::min(rpos + len, hi);
+      if (beg < end) {
+        const hts_pos_t off = beg - ref_beg;
+        count_cpg_block(ref + off, buf.data() + qpos + (beg - rpos), nbr,
+                        target, converted, end - beg, meth + off,
+                        unmeth + off);
+      }
+    }
+    if (type & 1) qpos += len;
+    if (type & 2) rpos += len;
+  }
+}
+
+// Walks a coordinate-sorted input one reference position at a time and
+// gives, for each covered position, one entry per read aligned there.
+// Reads being covered are kept at the front of a vector that grows to the
+// largest depth seen and is then reused, as are the bam_rec buffers in it
+// and the entry vector of the column, so no allocation happens per position
+// or per read in steady state. Reads with any of skip_flags set, or whose
+// CIGAR covers no reference bases (e.g. "4S"), are ignored. Entries point
+// at records in that vector and are valid only until the next call to
+// read().
+struct bam_pileup {
+  struct entry {
+    const bam_rec *rec{};
+    // qpos is -1 at a deletion, with base and qual 0. If SEQ is "*", base
+    // is 15 (N) and qual 0xff.
+    int32_t qpos{};  // in the query
+    uint8_t base{};  // 4-bit code as in bam_seqi
+    uint8_t qual{};
+    bool rev{};
+  };
+
+  struct column {
+    int32_t tid{};
+    hts_pos_t pos{};
+    std::vector<entry> entries;
+  };
+
+  bam_pileup(bam_in &in, bam_header &hdr,
+             const uint16_t skip_flags = BAM_FUNMAP | BAM_FSECONDARY |
+                                         BAM_FQCFAIL | BAM_FDUP)
+      : in{in}, hdr{hdr}, skip_flags{skip_flags}, active(16) {}
+
+  // Gives the next position covered by at least one read; false at EOF
+  auto read(column &col) -> bool {
+    for (;;) {
+      retire();
+      if (n_active == 0) {
+        if (!fill_pending()) return false;
+        tid = pending.b->core.tid;
+        pos = pending.b->core.pos;
+      }
+      while (fill_pending() && pending.b->core.tid == tid &&
+             pending.b->core.pos <= pos)
+        activate_pending();
+
+      col.tid = tid;
+      col.pos = pos;
+      col.entries.clear();
+      for (size_t i = 0; i < n_active; ++i) {
+        entry e;
+        if (entry_at(active[i], e)) col.entries.push_back(e);
+      }
+      ++pos;
+      if (!col.entries.empty()) return true;  // else all in ref skips
+    }
+  }
+
+  struct active_read {
+    bam_rec rec;
+    hts_pos_t end{};      // first position after the alignment
+    uint32_t op{};        // CIGAR op containing the current position
+    hts_pos_t op_rpos{};  // reference position where op starts
+    int32_t op_qpos{};    // query position where op starts
+  };
+
+  // Drops reads that end at or before pos; the rest keep their start order.
+  // Reads are ordered by start, not end, so one long read at the front
+  // must not hold back reads behind it that have already ended.
+  auto retire() -> void {
+    size_t kept = 0;
+    for (size_t i = 0; i < n_active; ++i)
+      if (active[i].end > pos) {
+        if (kept != i) std::swap(active[kept], active[i]);
+        ++kept;
+      }
+    n_active = kept;
+  }
+
+  auto fill_pending() -> bool {
+    if (has_pending) return true;
+    while (in.read(hdr, pending)) {
+      const bam1_t *b = pending.b;
+      if ((b->core.flag & skip_flags) == 0 && b->core.tid >= 0 &&
+          bam_cigar2rlen(b->core.n_cigar, bam_get_cigar(b)) > 0)
+        return has_pending = true;
+    }
+    return false;
+  }
+
+  auto activate_pending() -> void {
+    if (n_active == active.size()) active.resize(2 * active.size());
+    active_read &a = active[n_active++];
+    a.rec.swap(pending);  // the slot's old buffer becomes the next pending
+    a.end = a.rec.b->core.pos +
+            bam_cigar2rlen(a.rec.b->core.n_cigar, bam_get_cigar(a.rec.b));
+    a.op = 0;
+    a.op_rpos = a.rec.b->core.pos;
+    a.op_qpos = 0;
+    has_pending = false;
+  }
+
+  // Moves a's CIGAR cursor to pos; false if pos is in a reference skip
+  auto entry_at(active_read &a, entry &e) const -> bool {
+    const bam1_t *b = a.rec.b;
+    const uint32_t *cigar = bam_get_cigar(b);
+    for (; a.op < b->core.n_cigar; ++a.op) {
+      const uint32_t op = bam_cigar_op(cigar[a.op]);
+      const hts_pos_t len = bam_cigar_oplen(cigar[a.op]);
+      const int type = bam_cigar_type(op);
+      if ((type & 2) && pos < a.op_rpos + len) {
+        if (op == BAM_CREF_SKIP) return false;
+        e.rec = &a.rec;
+        e.rev = bam_is_rev(b);
+        if (!(type & 1)) {
+          e.qpos = -1;
+          e.base = e.qual = 0;
+        }
+        else if ((e.qpos = a.op_qpos + (pos - a.op_rpos)) < b->core.l_qseq) {
+          e.base = bam_seqi(bam_get_seq(b), e.qpos);
+          e.qual = bam_get_qual(b)[e.qpos];
+        }
+        else {
+          e.base = 15;
+          e.qual = 0xff;
+        }
+        return true;
+      }
+      if (type & 1) a.op_qpos += len;
+      if (type & 2) a.op_rpos += len;
+    }
+    return false;  // not reached, as pos < end
+  }
+
+  bam_in &in;
+  bam_header &hdr;
+  uint16_t skip_flags{};
+  std::vector<active_read> active;  // reads covering pos are [0, n_active)
+  size_t n_active{};
+  bam_rec pending;
+  bool has_pending{};
+  int32_t tid{-1};
+  hts_pos_t pos{};
+};
+
+// Running sum in place of a[0, n), starting from carry; returns the last
+// sum. SSE2 adds in log steps within each group of four.
+inline auto
+prefix_sum(int32_t *a, const size_t n, int32_t carry) -> int32_t {
+  size_t i = 0;
+#ifdef BAMXX_X86_SIMD
+  __m128i c = _mm_set1_epi32(carry);
+  for (; i + 4 <= n; i += 4) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi32(x, c);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(a + i), x);
+    c = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+  }
+  carry = _mm_cvtsi128_si32(c);
+#endif
+  for (; i < n; ++i) a[i] = carry += a[i];
+  return carry;
+}
+
+// Depth of coverage from a coordinate-sorted stream of records, written to
+// a bgzf_file as bedGraph with zero-depth intervals left out. Each aligned
+// block (CIGAR M, = or X) adds +1 and -1 to a difference array for the
+// current window, so the work per read is per block and not per base.
+// Positions are resolved with a prefix sum when a read starts past the
+// window, or at the end of each target. Call finish() after the last read.
+struct bam_coverage {
+  bam_coverage(bgzf_file &out, const bam_header &hdr,
+               const hts_pos_t window = 1 << 20,
+               const uint16_t skip_flags = BAM_FUNMAP | BAM_FSECONDARY |
+                                           BAM_FQCFAIL | BAM_FDUP)
+      : out{out}, hdr{hdr}, window{window}, skip_flags{skip_flags},
+        diff(window + 1) {}
+
+  ~bam_coverage() { finish(); }
+
+  auto add(const bam_rec &r) -> bool {
+    const bam1_core_t &c = r.b->core;
+    if ((c.flag & skip_flags) != 0 || c.tid < 0) return true;
+    if (c.tid != tid) {
+      if (!flush(wbeg + diff.size())) return false;
+      tid = c.tid;
+      wbeg = run_beg = c.pos;
+    }
+    else if (c.pos >= wbeg + window && !flush(c.pos))
+      return false;
+
+    hts_pos_t rpos = c.pos;
+    for (const auto x : r.cigar()) {
+      const int type = bam_cigar_type(bam_cigar_op(x));
+      const hts_pos_t len = bam_cigar_oplen(x);
+      if (type == 3) {
+        const size_t end = rpos + len - wbeg;
+        if (end >= diff.size()) diff.resize(end + 1);
+        ++diff[rpos - wbeg];
+        --diff[end];
+      }
+      if (type & 2) rpos += len;
+    }
+    return true;
+  }
+
+  // Writes out everything added so far
+  auto finish() -> bool {
+    bool ok = flush(wbeg + diff.size());
+    tid = -1;
+    if (!buf.empty()) ok = out.write(buf) && ok;
+    buf.clear();
+    return ok;
+  }
+
+  // Resolves positions [wbeg, end), all of which are final
+  auto flush(const hts_pos_t end) -> bool {
+    if (tid < 0) return true;
+    const size_t n = std::min<size_t>(end - wbeg, diff.size());
+    depth = prefix_sum(diff.data(), n, depth);
+    for (size_t i = 0; i < n; ++i)
+      if (diff[i] != run_depth) {
+        emit(wbeg + i);
+        run_beg = wbeg + i;
+        run_depth = diff[i];
+      }
+    wbeg += n;
+    std::copy(std::cbegin(diff) + n, std::cend(diff), std::begin(diff));
+    std::fill(std::end(diff) - n, std::end(diff), 0);
+    if (n == diff.size()) {  // no read reaches end: close the last run
+      emit(wbeg);
+      run_depth = depth = 0;
+      wbeg = run_beg = end;  // skip a gap so diff stays window + read span
+    }
+    if (buf.size() < (1 << 16)) return true;
+    const bool ok = out.write(buf);
+    buf.clear();
+    return ok;
+  }
+
+  auto emit(const hts_pos_t end) -> void {
+    if (run_depth <= 0 || end <= run_beg) return;
+    buf += hdr.name(tid);
+    for (const hts_pos_t x : {run_beg, end, hts_pos_t{run_depth}}) {
+      char num[24];
+      buf += '\t';
+      buf.append(num, std::to_chars(num, num + sizeof(num), x).ptr);
+    }
+    buf += '\n';
+  }
+
+  bgzf_file &out;
+  const bam_header &hdr;
+  hts_pos_t window{};
+  uint16_t skip_flags{};
+  std::vector<int32_t> diff;
+  int32_t tid{-1};
+  hts_pos_t wbeg{};        // position of diff[0]
+  int32_t depth{};         // depth just before wbeg
+  hts_pos_t run_beg{};     // interval of equal depth not yet written
+  int32_t run_depth{};
+  std::string buf;
+};
+
+// Merges two mates into one fragment record in `frag`; `left` must not
+// start after `right`. The left mate keeps its leading clips and the right
+// mate its trailing clips. Where the mates overlap, the left mate's bases
+// are kept, and a gap between them becomes a reference skip (N). The
+// fragment has the name, flag and strand of read 1, the lower mapq, no
+// mate fields and no aux data. The last three arguments are scratch space
+// so that merging does not allocate in steady state. Returns false without
+// merging if either mate has SEQ "*" or covers no reference bases.
+inline auto
+merge_mates(const bam_rec &left, const bam_rec &right, bam_rec &frag,
+            std::vector<uint32_t> &cigar, std::string &seq, std::string &qual)
+  -> bool {
+  const bam1_t *a = left.b, *b = right.b;
+  const hts_pos_t a_rlen = bam_cigar2rlen(a->core.n_cigar, bam_get_cigar(a));
+  if (a->core.l_qseq == 0 || b->core.l_qseq == 0 || a_rlen == 0 ||
+      bam_cigar2rlen(b->core.n_cigar, bam_get_cigar(b)) == 0)
+    return false;
+  const bool has_qual =
+    bam_get_qual(a)[0] != 0xff && bam_get_qual(b)[0] != 0xff;
+  cigar.clear();
+  seq.clear();
+  qual.clear();
+  const auto add_bases = [&](const bam1_t *x, const size_t beg,
+                             const size_t n) {
+    const size_t old = seq.size();
+    seq.resize(old + n);
+    decode_seq(bam_get_seq(x), beg, n, &seq[old]);
+    const uint8_t *q = bam_get_qual(x) + beg;
+    qual.append(q, q + n);
+  };
+  const auto add_op = [&](const uint32_t op, const uint32_t len) {
+    if (!cigar.empty() && bam_cigar_op(cigar.back()) == op)
+      cigar.back() += len << BAM_CIGAR_SHIFT;
+    else
+      cigar.push_back(bam_cigar_gen(len, op));
+  };
+  const auto is_clip = [](const uint32_t c) {
+    return bam_cigar_op(c) == BAM_CSOFT_CLIP ||
+           bam_cigar_op(c) == BAM_CHARD_CLIP;
+  };
+
+  // left mate without its trailing clips
+  const auto ca = left.cigar();
+  size_t n_ops = ca.size();
+  size_t qlen = a->core.l_qseq;
+  for (; n_ops > 0 && is_clip(ca[n_ops - 1]); --n_ops)
+    if (bam_cigar_op(ca[n_ops - 1]) == BAM_CSOFT_CLIP)
+      qlen -= bam_cigar_oplen(ca[n_ops - 1]);
+  cigar.assign(std::cbegin(ca), std::cbegin(ca) + n_ops);
+  add_bases(a, 0, qlen);
+  const hts_pos_t a_end = a->core.pos + a_rlen;
+
+  // right mate without its leading clips or the part overlapping the left
+  const auto cb = right.cigar();
+  size_t i = 0, qpos = 0;
+  for (; i < cb.size() && is_clip(cb[i]); ++i)
+    if (bam_cigar_op(cb[i]) == BAM_CSOFT_CLIP) qpos += bam_cigar_oplen(cb[i]);
+  hts_pos_t rpos = b->core.pos;
+  if (rpos > a_end) add_op(BAM_CREF_SKIP, rpos - a_end);
+  for (; i < cb.size(); ++i) {
+    const uint32_t op = bam_cigar_op(cb[i]);
+    const int type = bam_cigar_type(op);  // 1: query, 2: reference
+    uint32_t len = bam_cigar_oplen(cb[i]);
+    if (rpos < a_end) {
+      const uint32_t skip =
+        (type & 2) ? std::min<hts_pos_t>(len, a_end - rpos) : len;
+      if (type & 1) qpos += skip;
+      if (type & 2) rpos += skip;
+      len -= skip;
+      if (len == 0) continue;
+    }
+    add_op(op, len);
+    if (type & 1) {
+      add_bases(b, qpos, len);
+      qpos += len;
+    }
+    if (type & 2) rpos += len;
+  }
+
+  const bam1_t *r1 = (b->core.flag & BAM_FREAD1) ? b : a;
+  const uint16_t mate_bits = BAM_FPAIRED | BAM_FPROPER_PAIR | BAM_FMUNMAP |
+                             BAM_FMREVERSE | BAM_FREAD1 | BAM_FREAD2 |
+                             BAM_FREVERSE;
+  const uint16_t flag =
+    (a->core.flag & ~mate_bits) | (r1->core.flag & BAM_FREVERSE);
+  const auto qname = (r1 == a ? left : right).qname();
+  if (frag.b == nullptr) frag.b = bam_init1();
+  return bam_set1(frag.b, qname.size(), qname.data(), flag, a->core.tid,
+                  a->core.pos, std::min(a->core.qual, b->core.qual),
+                  cigar.size(), cigar.data(), -1, -1, 0, seq.size(),
+                  seq.data(), has_qual ? qual.data() : nullptr, 0) >= 0;
+}
+
+// Reads a coordinate-sorted input and gives each pair of mates as a single
+// fragment from merge_mates. A read waits in a hash table keyed on its
+// name, hashed straight from the bytes of the record, until its mate
+// arrives. It is given alone if the input passes its mate's position
+// without the mate showing up, or once more than max_pending reads are
+// waiting. Unpaired, unmapped, secondary and supplementary records and
+// mates on different targets are passed through unchanged. Fragments
+// appear when their second mate is read, so the output is not sorted.
+// Each record is copied into the caller's bam_rec, whose buffer is reused,
+// so records given out never use the merger's pool and may outlive it.
+struct bam_mate_merger {
+  bam_mate_merger(bam_in &in, bam_header &hdr,
+                  const size_t max_pending = 1 << 20)
+      : in{in}, hdr{hdr}, max_pending{max_pending} {}
+
+  auto read(bam_rec &frag) -> bool {
+    while (ready.empty()) {
+      bam_rec r = pool.get();
+      if (!in.read(hdr, r)) {
+        if (waiting.empty()) return false;
+        evict_front();  // at EOF every waiting read is alone
+        continue;
+      }
+      add(std::move(r));
+    }
+    if (frag.b == nullptr) frag.b = bam_init1();
+    if (bam_copy1(frag.b, ready.front().b) == nullptr)
+      throw std::runtime_error("failed to copy bam record");
+    pool.put(std::move(ready.front()));
+    ready.pop_front();
+    return true;
+  }
+
+  auto add(bam_rec &&r) -> void {
+    const bam1_core_t &c = r.b->core;
+    for (;;) {  // give up on waiting reads whose mate cannot come now
+      drop_done();
+      if (waiting.empty()) break;
+      const bam1_core_t &w = waiting.front().b->core;
+      if (w.tid == c.tid && w.mpos >= c.pos && by_name.size() <= max_pending)
+        break;
+      evict_front();
+    }
+    const uint16_t not_pairable = BAM_FUNMAP | BAM_FMUNMAP | BAM_FSECONDARY |
+                                  BAM_FSUPPLEMENTARY;
+    if (!(c.flag & BAM_FPAIRED) || (c.flag & not_pairable) || c.tid != c.mtid) {
+      ready.push_back(std::move(r));
+      return;
+    }
+    const auto mate = by_name.find(r.qname());
+    if (mate != std::end(by_name)) {
+      bam_rec &left = waiting[mate->second - first_waiting];
+      by_name.erase(mate);
+      bam_rec frag = pool.get();
+      if (merge_mates(left, r, frag, cigar, seq, qual)) {
+        ready.push_back(std::move(frag));
+        pool.put(std::move(left));
+        pool.put(std::move(r));
+      }
+      else {  // give the mates as they are
+        ready.push_back(std::move(left));
+        ready.push_back(std::move(r));
+      }
+      return;
+    }
+    if (c.mpos < c.pos) {  // mate already passed
+      ready.push_back(std::move(r));
+      return;
+    }
+    waiting.push_back(std::move(r));
+    by_name.emplace(waiting.back().qname(), first_waiting + waiting.size() - 1);
+  }
+
+  // Records already merged leave empty slots at the front
+  auto drop_done() -> void {
+    for (; !waiting.empty() && waiting.front().b == nullptr; ++first_waiting)
+      waiting.pop_front();
+  }
+
+  auto evict_front() -> void {
+    drop_done();
+    if (waiting.empty()) return;
+    by_name.erase(waiting.front().qname());
+    ready.push_back(std::move(waiting.front()));
+    waiting.pop_front();
+    ++first_waiting;
+  }
+
+  bam_in &in;
+  bam_header &hdr;
+  size_t max_pending{};
+  bam_rec_pool pool;
+  std::deque<bam_rec> waiting;  // in input order; empty once merged
+  uint64_t first_waiting{};     // number of the read at waiting.front()
+  std::unordered_map<std::string_view, uint64_t> by_name;  // keys in waiting
+  std::deque<bam_rec> ready;
+  std::vector<uint32_t> cigar;
+  std::string seq;
+  std::string qual;
 };
 
 };  // namespace bamxx
@@ -0,0 +1,520 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Andrew D Smith and Masaru Nakajima
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Benchmarks for the bamxx wrappers on synthetic data. The data is written
+// once per run to a temporary directory: a coordinate-sorted BAM and SAM of
+// 150bp bisulfite-like reads on one target, and a BGZF text file of tab
+// separated lines. BAMXX_BENCH_RECORDS sets the number of reads (default
+// 200000). Use --benchmark_format=json or --benchmark_out=<file> for JSON.
+
+#include "bamxx.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+using namespace bamxx;
+
+struct bench_data {
+  bench_data() {
+    const char *n = std::getenv("BAMXX_BENCH_RECORDS");
+    n_records = n == nullptr ? 200000 : std::strtoul(n, nullptr, 10);
+    const char *tmp = std::getenv("TMPDIR");
+    std::string tmpl = std::string(tmp == nullptr ? "/tmp" : tmp) +
+                       "/bamxx_bench.XXXXXX";
+    if (mkdtemp(&tmpl[0]) == nullptr)
+      throw std::runtime_error("failed to make temporary directory");
+    dir = tmpl;
+    bam_fn = dir + "/reads.bam";
+    sam_fn = dir + "/reads.sam";
+    txt_fn = dir + "/counts.txt.gz";
+    out_fn = dir + "/out.bam";
+
+    std::mt19937 rng(1);
+    const hts_pos_t ref_len = std::max<hts_pos_t>(1000000, 10 * n_records);
+    ref.resize(ref_len);
+    for (auto &c : ref) c = "ACGT"[rng() % 4];
+    for (hts_pos_t i = 0; i + 1 < ref_len; i += 50) {  // add CpGs
+      ref[i] = 'C';
+      ref[i + 1] = 'G';
+    }
+
+    hdr.h = sam_hdr_init();
+    const std::string sq =
+      "@HD\tVN:1.6\tSO:coordinate\n@SQ\tSN:chr1\tLN:" +
+      std::to_string(ref_len) + "\n";
+    if (sam_hdr_add_lines(hdr.h, sq.c_str(), sq.size()) < 0)
+      throw std::runtime_error("failed to make header");
+
+    const size_t read_len = 150;
+    const uint32_t plain[] = {bam_cigar_gen(read_len, BAM_CMATCH)};
+    const uint32_t gapped[] = {bam_cigar_gen(70, BAM_CMATCH),
+                               bam_cigar_gen(2, BAM_CDEL),
+                               bam_cigar_gen(80, BAM_CMATCH)};
+    std::string seq, qual(read_len, 0);
+    for (size_t i = 0; i < n_records; ++i) {
+      const hts_pos_t pos = i * (ref_len - 2 * read_len) / n_records;
+      const bool gap = i % 10 == 0;
+      seq.clear();
+      seq.append(ref, pos, 70);
+      seq.append(ref, pos + (gap ? 72 : 70), 80);
+      for (auto &c : seq)
+        if (c == 'C' && rng() % 4 != 0) c = 'T';  // mostly unmethylated
+      for (auto &q : qual) q = 20 + rng() % 20;
+      const std::string name = "read" + std::to_string(i);
+      bam_rec r;
+      r.b = bam_init1();
+      if (bam_set1(r.b, name.size(), name.data(), i % 2 ? BAM_FREVERSE : 0,
+                   0, pos, 60, gap ? 3 : 1, gap ? gapped : plain, -1, -1, 0,
+                   seq.size(), seq.data(), qual.data(), 0) < 0)
+        throw std::runtime_error("failed to make record");
+      records.push_back(std::move(r));
+    }
+
+    for (const auto &fn_fmt : {std::make_pair(bam_fn, true),
+                               std::make_pair(sam_fn, false)}) {
+      bam_out out(fn_fmt.first, fn_fmt.second);
+      if (!out || !out.write(hdr))
+        throw std::runtime_error("failed to write " + fn_fmt.first);
+      for (const auto &r : records)
+        if (!out.write(hdr, r))
+          throw std::runtime_error("failed to write " + fn_fmt.first);
+    }
+
+    for (size_t i = 0; i < n_records; ++i)
+      lines += "chr1\t" + std::to_string(i * 50) + "\t+\tCpG\t" +
+               std::to_string(rng() % 1000 / 1000.0) + "\t" +
+               std::to_string(rng() % 60) + "\n";
+    bgzf_file txt(txt_fn, "w");
+    if (!txt || !txt.write(lines))
+      throw std::runtime_error("failed to write " + txt_fn);
+  }
+
+  ~bench_data() {
+    for (const auto &fn : {bam_fn, sam_fn, txt_fn, out_fn})
+      std::remove(fn.c_str());
+    rmdir(dir.c_str());
+  }
+
+  size_t n_records{};
+  std::string dir, bam_fn, sam_fn, txt_fn, out_fn;
+  std::string ref;
+  std::string lines;
+  bam_header hdr;
+  std::vector<bam_rec> records;
+};
+
+auto
+data() -> const bench_data & {
+  static const bench_data d;
+  return d;
+}
+
+auto
+max_threads() -> int {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// ---- reading and writing mapped reads ----
+
+auto
+BM_bam_in_read(benchmark::State &state) -> void {
+  const auto &fn = state.range(0) ? data().sam_fn : data().bam_fn;
+  for (auto _ : state) {
+    bam_in in(fn);
+    bam_header hdr(in);
+    bam_rec r;
+    size_t n = 0;
+    while (in.read(hdr, r)) ++n;
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetItemsProcessed(state.iterations() * data().n_records);
+  state.SetLabel(state.range(0) ? "sam" : "bam");
+}
+BENCHMARK(BM_bam_in_read)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// Page cache is warm for both, so this measures syscalls and copies only
+auto
+BM_bam_in_read_mmap(benchmark::State &state) -> void {
+  const bool mmap_input = state.range(0);
+  for (auto _ : state) {
+    bam_tpool tp(state.range(1));
+    bam_in in(data().bam_fn, mmap_input);
+    tp.set_io(in);
+    bam_header hdr(in);
+    bam_rec r;
+    size_t n = 0;
+    while (in.read(hdr, r)) ++n;
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetItemsProcessed(state.iterations() * data().n_records);
+  state.SetLabel(mmap_input ? "mmap" : "hfile");
+}
+BENCHMARK(BM_bam_in_read_mmap)
+  ->ArgsProduct({{0, 1}, {1, max_threads()}})
+  ->UseRealTime()
+  ->Unit(benchmark::kMillisecond);
+
+auto
+BM_bam_in_read_batch(benchmark::State &state) -> void {
+  std::vector<bam_rec> batch;
+  for (auto _ : state) {
+    bam_in in(data().bam_fn);
+    bam_header hdr(in);
+    size_t n = 0, k = 0;
+    while ((k = in.read_batch(hdr, batch, state.range(0))) > 0) n += k;
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetItemsProcessed(state.iterations() * data().n_records);
+}
+BENCHMARK(BM_bam_in_read_batch)
+  ->Arg(64)
+  ->Arg(1024)
+  ->Arg(8192)
+  ->Unit(benchmark::kMillisecond);
+
+// Buffers reads as a sorter would, with or without a bam_rec_pool
+auto
+BM_bam_in_read_buffered(benchmark::State &state) -> void {
+  const bool use_pool = state.range(0);
+  const size_t buffer_size = 100000;
+  bam_rec_pool pool;
+  std::vector<bam_rec> buf;
+  // without the pool, read() gives each record a bam1_t and data of its own
+  const auto next = [&] { return use_pool ? pool.get() : bam_rec{}; };
+  for (auto _ : state) {
+    bam_in in(data().bam_fn);
+    bam_header hdr(in);
+    for (bam_rec r = next(); in.read(hdr, r); r = next()) {
+      buf.push_back(std::move(r));
+      if (buf.size() == buffer_size) {
+        if (use_pool) pool.put(buf);
+        buf.clear();
+      }
+    }
+    if (use_pool) pool.put(buf);
+    buf.clear();
+  }
+  state.SetItemsProcessed(state.iterations() * data().n_records);
+  state.SetLabel(use_pool ? "pool" : "malloc");
+}
+BENCHMARK(BM_bam_in_read_buffered)
+  ->Arg(0)
+  ->Arg(1)
+  ->Unit(benchmark::kMillisecond);
+
+auto
+BM_bam_in_read_threads(benchmark::State &state) -> void {
+  for (auto _ : state) {
+    bam_tpool tp(state.range(0));
+    bam_in in(data().bam_fn);
+    tp.set_io(in);
+    bam_header hdr(in);
+    bam_rec r;
+    size_t n = 0;
+    while (in.read(hdr, r)) ++n;
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetItemsProcessed(state.iterations() * data().n_records);
+}
+BENCHMARK(BM_bam_in_read_threads)
+  ->RangeMultiplier(2)
+  ->Range(1, max_threads())
+  ->UseRealTime()
+  ->Unit(benchmark::kMillisecond);
+
+auto
+BM_bam_out_write(benchmark::State &state) -> void {
+  const auto &d = data();
+  for (auto _ : state) {
+    bam_tpool tp(state.range(0));
+    bam_out out(d.out_fn, true);
+    tp.set_io(out);
+    out.write(d.hdr);
+    for (const auto &r : d.records) out.write(d.hdr, r);
+  }
+  state.SetItemsProcessed(state.iterations() * d.n_records);
+}
+BENCHMARK(BM_bam_out_write)
+  ->RangeMultiplier(2)
+  ->Range(1, max_threads())
+  ->UseRealTime()
+  ->Unit(benchmark::kMillisecond);
+
+// ---- text files through bgzf_file ----
+
+auto
+BM_bgzf_file_write(benchmark::State &state) -> void {
+  const auto &d = data();
+  for (auto _ : state) {
+    bgzf_file out(d.out_fn, "w");
+    out.write(d.lines);
+  }
+  state.SetBytesProcessed(state.iterations() * d.lines.size());
+}
+BENCHMARK(BM_bgzf_file_write)->Unit(benchmark::kMillisecond);
+
+auto
+BM_getline_string(benchmark::State &state) -> void {
+  std::string line;
+  for (auto _ : state) {
+    bgzf_file in(data().txt_fn, "r");
+    size_t n = 0;
+    while (getline(in, line)) n += line.size();
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetBytesProcessed(state.iterations() * data().lines.size());
+}
+BENCHMARK(BM_getline_string)->Unit(benchmark::kMillisecond);
+
+auto
+BM_getline_string_view(benchmark::State &state) -> void {
+  std::string_view line;
+  for (auto _ : state) {
+    bgzf_file in(data().txt_fn, "r");
+    size_t n = 0;
+    while (getline(in, line)) n += line.size();
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetBytesProcessed(state.iterations() * data().lines.size());
+}
+BENCHMARK(BM_getline_string_view)->Unit(benchmark::kMillisecond);
+
+auto
+BM_bgzf_line_reader(benchmark::State &state) -> void {
+  std::vector<std::string_view> lines;
+  for (auto _ : state) {
+    bgzf_file in(data().txt_fn, "r");
+    bgzf_line_reader reader(in);
+    size_t n = 0;
+    while (reader.read(lines))
+      for (const auto &line : lines) n += line.size();
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetBytesProcessed(state.iterations() * data().lines.size());
+}
+BENCHMARK(BM_bgzf_line_reader)->Unit(benchmark::kMillisecond);
+
+// ---- bam_rec in containers ----
+
+auto
+BM_bam_rec_vector_growth(benchmark::State &state) -> void {
+  const auto &d = data();
+  const bool copy = state.range(0);
+  for (auto _ : state) {
+    std::vector<bam_rec> v;
+    for (const auto &r : d.records) {
+      bam_rec x;
+      if (copy)
+        x = r;
+      else
+        x.b = r.b;  // stands in for a record just read
+      v.push_back(std::move(x));
+    }
+    if (!copy)
+      for (auto &x : v) x.b = nullptr;  // owned by d.records
+  }
+  state.SetItemsProcessed(state.iterations() * d.n_records);
+  state.SetLabel(copy ? "copy" : "move");
+}
+BENCHMARK(BM_bam_rec_vector_growth)
+  ->Arg(0)
+  ->Arg(1)
+  ->Unit(benchmark::kMillisecond);
+
+auto
+BM_sort_records(benchmark::State &state) -> void {
+  std::vector<bam_rec> v;
+  std::mt19937 rng(2);
+  for (auto _ : state) {
+    state.PauseTiming();
+    v = data().records;
+    std::shuffle(std::begin(v), std::end(v), rng);
+    state.ResumeTiming();
+    sort_records(v, bam_less_coordinate{}, state.range(0));
+  }
+  state.SetItemsProcessed(state.iterations() * data().n_records);
+}
+BENCHMARK(BM_sort_records)
+  ->RangeMultiplier(2)
+  ->Range(1, max_threads())
+  ->UseRealTime()
+  ->Unit(benchmark::kMillisecond);
+
+// ---- sequence kernels ----
+
+auto
+random_packed(const size_t n) -> std::vector<uint8_t> {
+  std::mt19937 rng(3);
+  std::string s(n, 'A');
+  for (auto &c : s) c = "ACGT"[rng() % 4];
+  std::vector<uint8_t> packed((n + 1) / 2);
+  encode_seq(s.data(), n, packed.data());
+  return packed;
+}
+
+auto
+BM_decode_seq_scalar(benchmark::State &state) -> void {
+  const size_t n = state.range(0);
+  const auto packed = random_packed(n);
+  std::string out(n, 0);
+  for (auto _ : state) {
+    decode_seq_scalar(packed.data(), n, &out[0]);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_decode_seq_scalar)->RangeMultiplier(4)->Range(100, 20000);
+
+auto
+BM_decode_seq(benchmark::State &state) -> void {
+  const size_t n = state.range(0);
+  const auto packed = random_packed(n);
+  std::string out(n, 0);
+  for (auto _ : state) {
+    decode_seq(packed.data(), 0, n, &out[0]);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_decode_seq)->RangeMultiplier(4)->Range(100, 20000);
+
+// decode, reverse complement as text, encode again
+auto
+BM_revcomp_roundtrip(benchmark::State &state) -> void {
+  const size_t n = state.range(0);
+  auto packed = random_packed(n);
+  std::string s(n, 0);
+  for (auto _ : state) {
+    decode_seq(packed.data(), 0, n, &s[0]);
+    std::reverse(std::begin(s), std::end(s));
+    for (auto &c : s)
+      c = c == 'A' ? 'T' : c == 'C' ? 'G' : c == 'G' ? 'C' : c == 'T' ? 'A' : c;
+    encode_seq(s.data(), n, packed.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_revcomp_roundtrip)->RangeMultiplier(4)->Range(100, 20000);
+
+auto
+BM_revcomp_packed(benchmark::State &state) -> void {
+  const size_t n = state.range(0);
+  auto packed = random_packed(n);
+  for (auto _ : state) {
+    revcomp_packed(packed.data(), n);
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_revcomp_packed)->RangeMultiplier(4)->Range(100, 20000);
+
+// The per-base loop count_cpg_conversions replaces
+auto
+count_cpg_naive(const bam_rec &r, const char *ref, const hts_pos_t ref_beg,
+                const hts_pos_t ref_end, uint32_t *meth, uint32_t *unmeth)
+  -> void {
+  const uint8_t *seq = bam_get_seq(r.b);
+  hts_pos_t rpos = r.b->core.pos, qpos = 0;
+  for (const auto c : r.cigar()) {
+    const int type = bam_cigar_type(bam_cigar_op(c));
+    const hts_pos_t len = bam_cigar_oplen(c);
+    if (type == 3)
+      for (hts_pos_t i = 0; i < len; ++i) {
+        const hts_pos_t p = rpos + i;
+        if (p < ref_beg || p + 1 >= ref_end) continue;
+        if (ref[p - ref_beg] != 'C' || ref[p - ref_beg + 1] != 'G') continue;
+        const char b = seq_nt16_str[bam_seqi(seq, qpos + i)];
+        meth[p - ref_beg] += b == 'C';
+        unmeth[p - ref_beg] += b == 'T';
+      }
+    if (type & 1) qpos += len;
+    if (type & 2) rpos += len;
+  }
+}
+
+auto
+BM_count_cpg(benchmark::State &state) -> void {
+  const auto &d = data();
+  const bool naive = state.range(0);
+  std::vector<uint32_t> meth(d.ref.size()), unmeth(d.ref.size());
+  std::string buf;
+  for (auto _ : state) {
+    for (const auto &r : d.records)
+      if (naive)
+        count_cpg_naive(r, d.ref.data(), 0, d.ref.size(), meth.data(),
+                        unmeth.data());
+      else
+        count_cpg_conversions(r, false, d.ref.data(), 0, d.ref.size(),
+                              meth.data(), unmeth.data(), buf);
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * d.n_records);
+  state.SetLabel(naive ? "naive" : "simd");
+}
+BENCHMARK(BM_count_cpg)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+// ---- whole-file passes ----
+
+auto
+BM_pileup(benchmark::State &state) -> void {
+  for (auto _ : state) {
+    bam_in in(data().bam_fn);
+    bam_header hdr(in);
+    bam_pileup pileup(in, hdr);
+    bam_pileup::column col;
+    size_t n = 0;
+    while (pileup.read(col)) n += col.entries.size();
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetItemsProcessed(state.iterations() * data().n_records);
+}
+BENCHMARK(BM_pileup)->Unit(benchmark::kMillisecond);
+
+auto
+BM_coverage(benchmark::State &state) -> void {
+  for (auto _ : state) {
+    bam_in in(data().bam_fn);
+    bam_header hdr(in);
+    bgzf_file out(data().out_fn, "w");
+    bam_coverage cov(out, hdr);
+    bam_rec r;
+    while (in.read(hdr, r)) cov.add(r);
+    cov.finish();
+  }
+  state.SetItemsProcessed(state.iterations() * data().n_records);
+}
+BENCHMARK(BM_coverage)->Unit(benchmark::kMillisecond);
+
+}  // namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,80 @@
+#!/usr/bin/env bash
+# Builds bamxx_bench with profile-guided optimization and reports the
+# per-benchmark speedup over a plain build of the same configuration.
+#
+# usage: bench/pgo.sh [build-dir] [extra cmake args...]
+#
+# The training run and both timed runs use the synthetic workload from
+# bamxx_bench; set BAMXX_BENCH_RECORDS to change its size. Results are
+# written to <build-dir>/base.json and <build-dir>/pgo.json, and the median
+# real times are printed as a markdown table, also saved to
+# <build-dir>/pgo.md; with BAMXX_PGO_README=1 the table in README.md is
+# replaced as well.
+
+set -euo pipefail
+
+src=$(cd "$(dirname "$0")/.." && pwd)
+out=$(mkdir -p "${1:-build-pgo}" && cd "${1:-build-pgo}" && pwd)
+shift || true
+profile="$out/profile"
+
+configure() {
+  local dir=$1 pgo=$2
+  shift 2
+  cmake -S "$src" -B "$out/$dir" -DCMAKE_BUILD_TYPE=Release \
+    -DBAMXX_BUILD_BENCH=ON -DBAMXX_PGO="$pgo" -DBAMXX_PGO_DIR="$profile" "$@"
+  cmake --build "$out/$dir" -j
+}
+
+run() {
+  "$out/$1/bamxx_bench" --benchmark_out="$out/$2" \
+    --benchmark_out_format=json --benchmark_repetitions="${3:-5}" \
+    --benchmark_report_aggregates_only=true
+}
+
+rm -rf "$profile"
+configure base "" "$@"
+# gcc names profiles after object paths, so both passes share a build dir
+configure pgo GENERATE "$@"
+run pgo train.json 1
+if ls "$profile"/*.profraw > /dev/null 2>&1; then  # clang
+  llvm-profdata merge -output="$profile/default.profdata" "$profile"/*.profraw
+fi
+configure pgo USE "$@"
+
+run base base.json
+run pgo pgo.json
+
+cxx=$(sed -n 's/^CMAKE_CXX_COMPILER:[A-Z]*=//p' "$out/base/CMakeCache.txt")
+python3 - "$out/base.json" "$out/pgo.json" "$("$cxx" --version | head -n 1)" \
+  << 'EOF' | tee "$out/pgo.md"
+import json, sys
+def medians(fn):
+    data = json.load(open(fn))
+    return data['context'], {b['run_name']: (b['real_time'], b['time_unit'])
+                             for b in data['benchmarks']
+                             if b.get('aggregate_name') == 'median'}
+ctx, base = medians(sys.argv[1])
+pgo = medians(sys.argv[2])[1]
+print(f"{sys.argv[3]}, {ctx['num_cpus']} CPUs at {ctx['mhz_per_cpu']} MHz\n")
+print("| benchmark | base | pgo | unit | speedup |")
+print("|---|--:|--:|---|--:|")
+for name, (t, unit) in base.items():
+    if name in pgo:
+        u = pgo[name][0]
+        print(f"| `{name}` | {t:.4g} | {u:.4g} | {unit} | {t / u:.3f} |")
+EOF
+
+# with BAMXX_PGO_README=1, replace the table in the README with this run
+if [ "${BAMXX_PGO_README:-0}" = 1 ]; then
+  python3 - "$src/README.md" "$out/pgo.md" << 'EOF'
+import re, sys
+readme, table = open(sys.argv[1]).read(), open(sys.argv[2]).read()
+begin, end = '<!-- pgo-table -->\n', '<!-- /pgo-table -->\n'
+body, n = re.subn(re.escape(begin) + '.*?' + re.escape(end),
+                  lambda m: begin + table + end, readme, flags=re.S)
+if n != 1:
+    sys.exit('README.md: pgo-table markers not found')
+open(sys.argv[1], 'w').write(body)
+EOF
+fi
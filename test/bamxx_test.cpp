@@ -0,0 +1,948 @@
+/* MIT License
+ *
+ * Copyright (c) 2023 Andrew D Smith and Masaru Nakajima
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Tests of the bamxx kernels, file and thread wrappers and record-level
+// tools, mostly against simple per-base or per-record versions. Files are
+// written to a temporary directory under TMPDIR. Exits non-zero if any
+// check fails.
+
+#include "bamxx.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+using namespace bamxx;
+
+size_t n_failed = 0;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+auto
+check(const bool ok, const char *what, const char *file, const int line)
+  -> bool {
+  if (!ok) {
+    ++n_failed;
+    std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+  }
+  return ok;
+}
+
+struct tmp_dir {
+  tmp_dir() {
+    const char *tmp = std::getenv("TMPDIR");
+    path = std::string(tmp == nullptr ? "/tmp" : tmp) + "/bamxx_test.XXXXXX";
+    if (mkdtemp(&path[0]) == nullptr)
+      throw std::runtime_error("failed to make temporary directory");
+  }
+  ~tmp_dir() {
+    for (const auto &fn : files) std::remove(fn.c_str());
+    rmdir(path.c_str());
+  }
+  // the file and any index or run files made from it are removed at exit
+  auto file(const std::string &name) -> std::string {
+    const std::string fn = path + "/" + name;
+    for (const auto ext : {"", ".bai", ".csi"}) files.push_back(fn + ext);
+    return fn;
+  }
+  std::string path;
+  std::vector<std::string> files;
+};
+
+auto
+parse_cigar(const std::string &s) -> std::vector<uint32_t> {
+  static const std::string ops = "MIDNSHP=X";
+  std::vector<uint32_t> cigar;
+  uint32_t len = 0;
+  for (const auto c : s)
+    if (c >= '0' && c <= '9')
+      len = 10 * len + (c - '0');
+    else {
+      cigar.push_back(bam_cigar_gen(len, ops.find(c)));
+      len = 0;
+    }
+  return cigar;
+}
+
+auto
+cigar_string(const bam_rec &r) -> std::string {
+  std::string s;
+  for (const auto c : r.cigar())
+    s += std::to_string(bam_cigar_oplen(c)) + "MIDNSHP=X"[bam_cigar_op(c)];
+  return s;
+}
+
+auto
+seq_string(const bam_rec &r) -> std::string {
+  std::string s(r.b->core.l_qseq, 0);
+  decode_seq(bam_get_seq(r.b), 0, s.size(), &s[0]);
+  return s;
+}
+
+// seq "*" gives a record with no sequence; qualities are 30 + i % 10
+auto
+make_rec(const std::string &name, const uint16_t flag, const int32_t tid,
+         const hts_pos_t pos, const std::string &cigar_str,
+         const std::string &seq) -> bam_rec {
+  const auto cigar = parse_cigar(cigar_str);
+  const size_t l_seq = seq == "*" ? 0 : seq.size();
+  std::string qual(l_seq, 0);
+  for (size_t i = 0; i < l_seq; ++i) qual[i] = 30 + i % 10;
+  bam_rec r;
+  r.b = bam_init1();
+  if (bam_set1(r.b, name.size(), name.data(), flag, tid, pos, 60,
+               cigar.size(), cigar.data(), -1, -1, 0, l_seq, seq.data(),
+               qual.data(), 0) < 0)
+    throw std::runtime_error("failed to make record " + name);
+  return r;
+}
+
+auto
+init_header(bam_header &hdr, const std::string &sq_lines) -> void {
+  hdr.h = sam_hdr_init();
+  const std::string text = "@HD\tVN:1.6\n" + sq_lines;
+  if (hdr.h == nullptr || sam_hdr_add_lines(hdr.h, text.data(), 0) < 0)
+    throw std::runtime_error("failed to make header");
+}
+
+// with `index`, recs must be sorted by coordinate
+auto
+write_bam(const std::string &fn, const bam_header &hdr,
+          const std::vector<bam_rec> &recs, const bool index = false)
+  -> bool {
+  bam_out out(fn, true);
+  if (!out || !out.write(hdr)) return false;
+  if (index && !out.init_index(hdr)) return false;
+  for (const auto &r : recs)
+    if (!out.write(hdr, r)) return false;
+  return !index || out.save_index();
+}
+
+auto
+set_mate(bam_rec &r, const int32_t mtid, const hts_pos_t mpos) -> void {
+  r.b->core.mtid = mtid;
+  r.b->core.mpos = mpos;
+}
+
+auto
+same_rec(const bam_rec &a, const bam_rec &b) -> bool {
+  return a.qname() == b.qname() && a.b->core.tid == b.b->core.tid &&
+         a.b->core.pos == b.b->core.pos && cigar_string(a) == cigar_string(b) &&
+         seq_string(a) == seq_string(b);
+}
+
+auto
+random_bases(std::mt19937 &rng, const size_t n, const char *alphabet)
+  -> std::string {
+  const size_t k = std::strlen(alphabet);
+  std::string s(n, 0);
+  for (auto &c : s) c = alphabet[rng() % k];
+  return s;
+}
+
+// ---- kernels ----
+
+auto
+test_decode_seq() -> void {
+#ifdef BAMXX_X86_SIMD
+  __builtin_cpu_init();
+#endif
+  std::mt19937 rng(1);
+  for (size_t n = 0; n < 200; ++n) {  // every length modulo 64, and then some
+    const std::string seq = random_bases(rng, n + 1, "=ACMGRSVTWYHKDBN");
+    std::vector<uint8_t> packed(n / 2 + 1);
+    encode_seq(seq.data(), n + 1, packed.data());
+    for (const size_t beg : {0, 1}) {
+      if (beg > n) continue;
+      std::string out(n - beg, 0);
+      decode_seq(packed.data(), beg, n - beg, &out[0]);
+      CHECK(out == seq.substr(beg, n - beg));
+    }
+    std::string scalar(n, 0);
+    decode_seq_scalar(packed.data(), n, &scalar[0]);
+    CHECK(scalar == seq.substr(0, n));
+#ifdef BAMXX_X86_SIMD
+    std::string simd(n, 0);
+    if (__builtin_cpu_supports("ssse3")) {
+      decode_seq_ssse3(packed.data(), n, &simd[0]);
+      CHECK(simd == scalar);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      decode_seq_avx2(packed.data(), n, &simd[0]);
+      CHECK(simd == scalar);
+    }
+#endif
+  }
+}
+
+auto
+test_revcomp() -> void {
+  static const std::string alphabet = "=ACMGRSVTWYHKDBN";
+  static const std::string complement = "=TGKCYSBAWRDMHVN";
+  std::mt19937 rng(2);
+  for (size_t n = 0; n < 300; ++n) {
+    const std::string seq = random_bases(rng, n, alphabet.c_str());
+    std::string expected(seq.rbegin(), seq.rend());
+    for (auto &c : expected) c = complement[alphabet.find(c)];
+    std::vector<uint8_t> packed((n + 1) / 2 + 1, 0xaa);
+    encode_seq(seq.data(), n, packed.data());
+    revcomp_packed(packed.data(), n);
+    std::string out(n, 0);
+    decode_seq_scalar(packed.data(), n, &out[0]);
+    CHECK(out == expected);
+    CHECK(packed.back() == 0xaa);  // nothing written past the sequence
+
+    std::vector<uint8_t> bytes(n), scalar(n);
+    for (auto &x : bytes) x = rng();
+    scalar = bytes;
+    reverse_bytes_scalar<true>(scalar.data(), n);
+    std::vector<uint8_t> simd = bytes;
+    reverse_bytes<true>(simd.data(), n);
+    CHECK(simd == scalar);
+    scalar = simd = bytes;
+    reverse_bytes_scalar<false>(scalar.data(), n);
+    reverse_bytes<false>(simd.data(), n);
+    CHECK(simd == scalar);
+  }
+}
+
+auto
+test_prefix_sum() -> void {
+  std::mt19937 rng(3);
+  for (size_t n = 0; n < 70; ++n) {
+    std::vector<int32_t> a(n);
+    for (auto &x : a) x = static_cast<int32_t>(rng() % 21) - 10;
+    const int32_t carry = static_cast<int32_t>(rng() % 100) - 50;
+    std::vector<int32_t> expected(n);
+    int32_t sum = carry;
+    for (size_t i = 0; i < n; ++i) expected[i] = sum += a[i];
+    CHECK(prefix_sum(a.data(), n, carry) == sum);
+    CHECK(a == expected);
+  }
+}
+
+auto
+test_count_cpg_block() -> void {
+  std::mt19937 rng(4);
+  for (size_t n = 0; n < 100; ++n)
+    for (const bool ga : {false, true}) {
+      // one base of padding each side so ref[i + nbr] is always valid
+      const std::string ref = random_bases(rng, n + 2, "ACGTacgtN");
+      const std::string read = random_bases(rng, n, "ACGTN");
+      const int nbr = ga ? -1 : 1;
+      const char target = ga ? 'G' : 'C', partner = ga ? 'C' : 'G';
+      const char converted = ga ? 'A' : 'T';
+      std::vector<uint32_t> meth(n, 1), unmeth(n, 2);
+      std::vector<uint32_t> exp_meth(meth), exp_unmeth(unmeth);
+      for (size_t i = 0; i < n; ++i) {
+        const auto upper = [](const char c) { return c & 0xdf; };
+        if (upper(ref[i + 1]) == target && upper(ref[i + 1 + nbr]) == partner) {
+          exp_meth[i] += read[i] == target;
+          exp_unmeth[i] += read[i] == converted;
+        }
+      }
+      count_cpg_block(ref.data() + 1, read.data(), nbr, target, converted, n,
+                      meth.data(), unmeth.data());
+      CHECK(meth == exp_meth);
+      CHECK(unmeth == exp_unmeth);
+    }
+}
+
+// ---- record-level tools ----
+
+auto
+test_coverage(tmp_dir &tmp) -> void {
+  bam_header hdr;
+  init_header(hdr, "@SQ\tSN:c0\tLN:100000000\n@SQ\tSN:c1\tLN:1000\n");
+  std::vector<bam_rec> recs;
+  // overlapping reads, a deletion, a splice, a 45 Mb gap and a new target
+  recs.push_back(make_rec("a", 0, 0, 100, "10M", std::string(10, 'A')));
+  recs.push_back(make_rec("b", 0, 0, 105, "5M3D5M", std::string(10, 'A')));
+  recs.push_back(make_rec("c", 0, 0, 108, "2S4M50N4M", std::string(10, 'A')));
+  recs.push_back(make_rec("d", BAM_FDUP, 0, 110, "10M", std::string(10, 'A')));
+  recs.push_back(make_rec("e", 0, 0, 45000000, "20M", std::string(20, 'A')));
+  recs.push_back(make_rec("f", 0, 0, 45000010, "20M", std::string(20, 'A')));
+  recs.push_back(make_rec("g", 0, 1, 0, "5M", std::string(5, 'A')));
+
+  std::map<std::pair<int32_t, hts_pos_t>, int32_t> depth;
+  for (const auto &r : recs) {
+    if (r.b->core.flag & BAM_FDUP) continue;
+    hts_pos_t pos = r.b->core.pos;
+    for (const auto c : r.cigar()) {
+      const int type = bam_cigar_type(bam_cigar_op(c));
+      for (uint32_t j = 0; type == 3 && j < bam_cigar_oplen(c); ++j)
+        ++depth[{r.b->core.tid, pos + j}];
+      if (type & 2) pos += bam_cigar_oplen(c);
+    }
+  }
+  std::string expected;
+  const auto add_run = [&](int32_t tid, hts_pos_t beg, hts_pos_t end, int d) {
+    expected += "c" + std::to_string(tid) + "\t" + std::to_string(beg) +
+                "\t" + std::to_string(end) + "\t" + std::to_string(d) + "\n";
+  };
+  int32_t tid = -1, d = 0;
+  hts_pos_t beg = 0, end = 0;
+  for (const auto &x : depth) {
+    if (x.first.first == tid && x.first.second == end && x.second == d) {
+      ++end;
+      continue;
+    }
+    if (tid >= 0) add_run(tid, beg, end, d);
+    std::tie(tid, beg) = x.first;
+    end = beg + 1;
+    d = x.second;
+  }
+  if (tid >= 0) add_run(tid, beg, end, d);
+
+  const std::string fn = tmp.file("coverage.bedgraph.gz");
+  const hts_pos_t window = 16;
+  size_t max_diff = 0;
+  {
+    bgzf_file out(fn, "w");
+    bam_coverage cov(out, hdr, window);
+    for (const auto &r : recs) {
+      CHECK(cov.add(r));
+      max_diff = std::max(max_diff, cov.diff.size());
+    }
+    CHECK(cov.finish());
+  }
+  CHECK(max_diff <= window + 1 + 64);  // window plus the longest read span
+  bgzf_file in(fn, "r");
+  std::string got, line;
+  while (getline(in, line)) got += line + "\n";
+  CHECK(got == expected);
+}
+
+auto
+test_pileup(tmp_dir &tmp) -> void {
+  bam_header hdr;
+  init_header(hdr, "@SQ\tSN:c0\tLN:1000\n");
+  std::vector<bam_rec> recs;
+  recs.push_back(make_rec("clip", 0, 0, 10, "4S", "ACGT"));
+  recs.push_back(make_rec("del", 0, 0, 10, "5M2D5M", "ACGTACGTAC"));
+  recs.push_back(make_rec("splice", 0, 0, 12, "3M100N3M", "GGGCCC"));
+  recs.push_back(make_rec("short", 0, 0, 13, "4M", "TTTT"));
+  recs.push_back(make_rec("ins", 0, 0, 20, "50I", std::string(50, 'A')));
+  recs.push_back(make_rec("clipped", 0, 0, 20, "2S4M", "NNACGT"));
+  recs.push_back(make_rec("after", 0, 0, 116, "5M", "ACGTA"));
+  recs.push_back(make_rec("noseq", 0, 0, 200, "3M", "*"));
+  const std::string fn = tmp.file("pileup.bam");
+  CHECK(write_bam(fn, hdr, recs));
+
+  // (pos, name, qpos, base, qual) for every aligned or deleted base
+  using item = std::tuple<hts_pos_t, std::string, int32_t, char, int>;
+  std::vector<item> expected;
+  for (const auto &r : recs) {
+    const bam1_t *b = r.b;
+    if (bam_cigar2rlen(b->core.n_cigar, bam_get_cigar(b)) == 0) continue;
+    hts_pos_t pos = b->core.pos;
+    int32_t qpos = 0;
+    const std::string seq = seq_string(r);
+    for (const auto c : r.cigar()) {
+      const uint32_t op = bam_cigar_op(c), len = bam_cigar_oplen(c);
+      const int type = bam_cigar_type(op);
+      for (uint32_t j = 0; (type & 2) && op != BAM_CREF_SKIP && j < len; ++j)
+        if (!(type & 1))
+          expected.emplace_back(pos + j, std::string(r.qname()), -1, '=', 0);
+        else if (seq.empty())
+          expected.emplace_back(pos + j, std::string(r.qname()), qpos + j, 'N',
+                                0xff);
+        else
+          expected.emplace_back(pos + j, std::string(r.qname()), qpos + j,
+                                seq[qpos + j], 30 + (qpos + j) % 10);
+      if (type & 1) qpos += len;
+      if (type & 2) pos += len;
+    }
+  }
+
+  bam_in in(fn);
+  bam_header in_hdr(in);
+  bam_pileup pileup(in, in_hdr);
+  bam_pileup::column col;
+  std::vector<item> got;
+  hts_pos_t prev = -1;
+  while (pileup.read(col)) {
+    CHECK(col.tid == 0 && col.pos > prev);
+    prev = col.pos;
+    CHECK(!col.entries.empty());
+    if (col.pos == 116) CHECK(pileup.n_active == 2);  // splice and after
+    for (const auto &e : col.entries)
+      got.emplace_back(col.pos, std::string(e.rec->qname()), e.qpos,
+                       seq_nt16_str[e.base], e.qual);
+  }
+  std::sort(std::begin(expected), std::end(expected));
+  std::sort(std::begin(got), std::end(got));
+  CHECK(got == expected);
+}
+
+auto
+test_merge_mates() -> void {
+  std::vector<uint32_t> cigar;
+  std::string seq, qual;
+  const auto merge = [&](const bam_rec &a, const bam_rec &b, bam_rec &frag) {
+    return merge_mates(a, b, frag, cigar, seq, qual);
+  };
+  const uint16_t r1 = BAM_FPAIRED | BAM_FREAD1, r2 = BAM_FPAIRED | BAM_FREAD2;
+  bam_rec frag;
+
+  // overlapping: the left mate's bases are kept where they overlap
+  const auto a = make_rec("p", r1, 0, 100, "2S10M", "GGAAAAACCCCC");
+  const auto b =
+    make_rec("p", r2 | BAM_FREVERSE, 0, 105, "10M3S", "TTTTTGGGGGAAA");
+  if (CHECK(merge(a, b, frag))) {
+    CHECK(cigar_string(frag) == "2S15M3S");
+    CHECK(seq_string(frag) == "GGAAAAACCCCCGGGGGAAA");
+    CHECK(frag.b->core.pos == 100 && frag.qname() == "p");
+    CHECK(!(frag.b->core.flag & (BAM_FPAIRED | BAM_FREAD1 | BAM_FREVERSE)));
+  }
+
+  // contained: the right mate adds nothing, not even its clip
+  const auto c = make_rec("q", r2, 0, 100, "20M", std::string(20, 'C'));
+  const auto d = make_rec("q", r1 | BAM_FREVERSE, 0, 105, "5M2S", "AAAAATT");
+  if (CHECK(merge(c, d, frag))) {
+    CHECK(cigar_string(frag) == "20M");
+    CHECK(seq_string(frag) == std::string(20, 'C'));
+    CHECK(frag.b->core.flag & BAM_FREVERSE);  // strand of read 1
+  }
+
+  // gapped: the gap becomes a reference skip
+  const auto e = make_rec("r", r1, 0, 100, "10M", std::string(10, 'A'));
+  const auto f = make_rec("r", r2, 0, 120, "3M1I6M", std::string(10, 'T'));
+  if (CHECK(merge(e, f, frag))) {
+    CHECK(cigar_string(frag) == "10M10N3M1I6M");
+    CHECK(seq_string(frag) == std::string(10, 'A') + std::string(10, 'T'));
+    CHECK(frag.b->core.l_qseq == 20);
+  }
+
+  // mates with no sequence or no reference span are not merged
+  const auto g = make_rec("s", r1, 0, 100, "10M", "*");
+  const auto h = make_rec("s", r2, 0, 100, "10S", std::string(10, 'A'));
+  CHECK(!merge(g, e, frag));
+  CHECK(!merge(e, g, frag));
+  CHECK(!merge(h, e, frag));
+}
+
+auto
+test_sort_bam(tmp_dir &tmp) -> void {
+  bam_header hdr;
+  init_header(hdr, "@SQ\tSN:c0\tLN:100000\n@SQ\tSN:c1\tLN:100000\n");
+  std::mt19937 rng(5);
+  std::vector<bam_rec> recs;
+  for (size_t i = 0; i < 5000; ++i) {
+    const std::string name = "r" + std::to_string(rng() % 3000) + ":" +
+                             std::to_string(rng() % 20);
+    if (rng() % 20 == 0)
+      recs.push_back(make_rec(name, BAM_FUNMAP, -1, -1, "", "ACGT"));
+    else
+      recs.push_back(make_rec(name, rng() % 2 ? BAM_FREVERSE : 0, rng() % 2,
+                              rng() % 100000, "50M", std::string(50, 'A')));
+  }
+  const std::string in_fn = tmp.file("unsorted.bam");
+  CHECK(write_bam(in_fn, hdr, recs));
+
+  std::vector<std::string> names;
+  for (const auto &r : recs) names.emplace_back(r.qname());
+  std::sort(std::begin(names), std::end(names));
+
+  for (const bool by_name : {false, true}) {
+    bam_sort_config cfg;
+    cfg.max_mem = 64 << 10;  // force several temporary runs
+    cfg.n_threads = 2;
+    cfg.by_name = by_name;
+    const std::string out_fn = tmp.file(by_name ? "name.bam" : "coord.bam");
+    CHECK(sort_bam(in_fn, out_fn, cfg));
+
+    bam_in in(out_fn);
+    bam_header out_hdr(in);
+    const auto hd = out_hdr.lines("HD");
+    CHECK(hd.size() == 1);
+    if (!hd.empty()) {
+      CHECK(bam_header::tag_value(hd[0], "SO") ==
+            (by_name ? "queryname" : "coordinate"));
+      CHECK(bam_header::tag_value(hd[0], "SS") ==
+            (by_name ? "queryname:natural" : ""));
+    }
+    std::vector<bam_rec> sorted;
+    for (bam_rec r; in.read(out_hdr, r);) sorted.push_back(std::move(r));
+    CHECK(sorted.size() == recs.size());
+    for (size_t i = 1; i < sorted.size(); ++i)
+      CHECK(by_name ? !bam_less_queryname{}(sorted[i], sorted[i - 1])
+                    : !bam_less_coordinate{}(sorted[i], sorted[i - 1]));
+    std::vector<std::string> got;
+    for (const auto &r : sorted) got.emplace_back(r.qname());
+    std::sort(std::begin(got), std::end(got));
+    CHECK(got == names);
+  }
+  CHECK(natural_name_cmp("r2", "r10") < 0);
+  CHECK(natural_name_cmp("r007", "r7") == 0);
+  CHECK(natural_name_cmp("r1:12", "r1:5") > 0);
+}
+
+auto
+test_merger_stream(tmp_dir &tmp) -> void {
+  bam_header hdr;
+  init_header(hdr, "@SQ\tSN:c0\tLN:10000\n@SQ\tSN:c1\tLN:10000\n");
+  const uint16_t r1 = BAM_FPAIRED | BAM_FREAD1, r2 = BAM_FPAIRED | BAM_FREAD2;
+  const std::string s10(10, 'A');
+  std::vector<bam_rec> recs;
+  const auto add = [&](const std::string &name, const uint16_t flag,
+                       const int32_t tid, const hts_pos_t pos,
+                       const int32_t mtid, const hts_pos_t mpos) {
+    recs.push_back(make_rec(name, flag, tid, pos, "10M", s10));
+    set_mate(recs.back(), mtid, mpos);
+  };
+  add("a", r1, 0, 100, 0, 105);                 // overlapping mates
+  add("a", r2 | BAM_FREVERSE, 0, 105, 0, 100);  //
+  add("u", 0, 0, 110, -1, -1);                  // unpaired
+  add("b", r1, 0, 200, 1, 50);                  // mate on another target
+  add("c", r1, 0, 300, 0, 900);                 // mates with a gap
+  add("d", r1, 0, 400, 0, 350);                 // mate already passed
+  add("e", r1 | BAM_FSECONDARY, 0, 500, 0, 510);
+  add("c", r2, 0, 900, 0, 300);
+  add("b", r2, 1, 50, 0, 200);
+  const std::string fn = tmp.file("mates.bam");
+  CHECK(write_bam(fn, hdr, recs));
+
+  std::vector<std::string> expected = {
+    "a 15M", "u 10M", "b 10M", "c 10M590N10M", "d 10M", "e 10M", "b 10M"};
+  std::vector<std::string> got;
+  bam_in in(fn);
+  bam_header in_hdr(in);
+  bam_rec frag;
+  std::string last;
+  {
+    bam_mate_merger merger(in, in_hdr);
+    while (merger.read(frag)) {
+      last = std::string(frag.qname()) + " " + cigar_string(frag);
+      got.push_back(last);
+    }
+  }
+  // the record given out is the caller's own and outlives the merger
+  CHECK(std::string(frag.qname()) + " " + cigar_string(frag) == last);
+  std::sort(std::begin(expected), std::end(expected));
+  std::sort(std::begin(got), std::end(got));
+  CHECK(got == expected);
+}
+
+// ---- files ----
+
+auto
+test_header_lookup() -> void {
+  const int32_t n = 500;
+  std::string sq;
+  for (int32_t i = 0; i < n; ++i)
+    sq += "@SQ\tSN:chr" + std::to_string(i) +
+          "\tLN:" + std::to_string(1000 + i) + "\n";
+  bam_header hdr;
+  init_header(hdr, sq);
+  const bam_header &shared = hdr;
+  CHECK(shared.n_targets() == n);
+
+  // threads making the first lookup at once all see the whole table
+  std::atomic<size_t> n_wrong{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t)
+    threads.emplace_back([&] {
+      for (int32_t i = 0; i < n; ++i) {
+        const std::string name = "chr" + std::to_string(i);
+        if (shared.tid(name) != i || shared.name(i) != name ||
+            shared.length(i) != 1000 + i)
+          ++n_wrong;
+      }
+    });
+  for (auto &t : threads) t.join();
+  CHECK(n_wrong == 0);
+  CHECK(shared.tid("chr500") == -1);
+  CHECK(shared.tid("") == -1);
+  CHECK(shared.tid("chr1 ") == -1);
+
+  CHECK(hdr.add_pg_line("bamxx_test", "test", "1"));
+  CHECK(hdr.lines("PG").size() == 1);
+  CHECK(hdr.tid("chr499") == 499 && hdr.name(0) == "chr0");
+  const bam_header copy(hdr);
+  CHECK(copy.tid("chr7") == 7 && copy.length(7) == 1007);
+}
+
+auto
+test_read_paths(tmp_dir &tmp) -> void {
+  bam_header hdr;
+  init_header(hdr, "@SQ\tSN:c0\tLN:100000\n");
+  std::mt19937 rng(6);
+  std::vector<bam_rec> recs;
+  for (size_t i = 0; i < 1000; ++i) {
+    const size_t len = 20 + rng() % 300;  // many outgrow a 256-byte block
+    recs.push_back(make_rec("r" + std::to_string(i), 0, 0, 10 * i,
+                            std::to_string(len) + "M",
+                            random_bases(rng, len, "ACGT")));
+  }
+  const std::string fn = tmp.file("read.bam");
+  CHECK(write_bam(fn, hdr, recs));
+
+  for (const bool mmap_input : {false, true}) {
+    bam_in in(fn, mmap_input);
+    if (!CHECK(in)) continue;
+    CHECK(!mmap_input || in.map != nullptr);
+    bam_header in_hdr(in);
+    size_t n = 0;
+    for (bam_rec r; in.read(in_hdr, r); ++n)
+      if (n >= recs.size() || !same_rec(r, recs[n])) break;
+    CHECK(n == recs.size());
+  }
+
+  {  // batches: full ones, then the rest, then 0 at EOF
+    bam_in in(fn);
+    bam_header in_hdr(in);
+    std::vector<bam_rec> batch;
+    size_t n = 0, k = 0, n_bad = 0;
+    while ((k = in.read_batch(in_hdr, batch, 64)) > 0) {
+      CHECK(k == 64 || n + k == recs.size());
+      for (size_t i = 0; i < k; ++i) n_bad += !same_rec(batch[i], recs[n + i]);
+      n += k;
+    }
+    CHECK(n == recs.size() && n_bad == 0);
+    CHECK(batch.size() == 64);
+  }
+
+  {  // pool records: slab blocks, or a buffer of their own once outgrown
+    bam_rec_pool pool(256, 16);
+    bam_in in(fn);
+    bam_header in_hdr(in);
+    std::vector<bam_rec> got;
+    for (bam_rec r = pool.get(); in.read(in_hdr, r); r = pool.get())
+      got.push_back(std::move(r));
+    size_t n_bad = 0;
+    for (size_t i = 0; i < got.size() && i < recs.size(); ++i) {
+      const bool in_slab = bam_get_mempolicy(got[i].b) & BAM_USER_DATA;
+      n_bad += !same_rec(got[i], recs[i]);
+      n_bad += in_slab != (got[i].b->l_data <= 256);
+    }
+    CHECK(got.size() == recs.size() && n_bad == 0);
+    CHECK(pool.slabs.size() == (recs.size() + 1 + 15) / 16);
+    const bam1_t *const last = got.back().b;
+    pool.put(got);
+    CHECK(got.empty() && pool.free_recs.size() == recs.size());
+    bam_rec r = pool.get();  // recycled, with its bam1_t and buffer
+    CHECK(r.b == last);
+    pool.put(std::move(r));
+  }
+}
+
+auto
+test_index_and_shards(tmp_dir &tmp) -> void {
+  bam_header hdr;
+  init_header(hdr, "@SQ\tSN:c0\tLN:2000000\n@SQ\tSN:c1\tLN:100000\n");
+  std::mt19937 rng(7);
+  // 6000 reads in the first 50 kb of c0 and 2000 over the rest, so an even
+  // split by length would put most of the work in one shard
+  std::vector<std::pair<int32_t, hts_pos_t>> starts;
+  for (size_t i = 0; i < 6000; ++i) starts.emplace_back(0, rng() % 50000);
+  for (size_t i = 0; i < 2000; ++i)
+    starts.emplace_back(0, 50000 + rng() % 1949000);
+  for (size_t i = 0; i < 100; ++i) starts.emplace_back(1, rng() % 99000);
+  std::sort(std::begin(starts), std::end(starts));
+  std::vector<bam_rec> recs;
+  for (size_t i = 0; i < starts.size(); ++i)
+    recs.push_back(make_rec("q" + std::to_string(i), 0, starts[i].first,
+                            starts[i].second,
+                            i % 10 == 0 ? "20M500N30M" : "50M",
+                            random_bases(rng, 50, "ACGT")));
+  for (size_t i = 0; i < 10; ++i)
+    recs.push_back(make_rec("z" + std::to_string(i), BAM_FUNMAP, -1, -1, "",
+                            "ACGT"));
+  const std::string fn = tmp.file("indexed.bam");
+  CHECK(write_bam(fn, hdr, recs, true));
+
+  const auto overlapping = [&](const int32_t tid, const hts_pos_t beg,
+                               const hts_pos_t end) {
+    std::vector<std::string> names;
+    for (const auto &r : recs)
+      if (r.b->core.tid == tid && r.b->core.pos < end && bam_endpos(r.b) > beg)
+        names.emplace_back(r.qname());
+    std::sort(std::begin(names), std::end(names));
+    return names;
+  };
+  const auto names_of = [](bam_itr &itr) {
+    std::vector<std::string> names;
+    for (auto &r : itr) names.emplace_back(r.qname());
+    std::sort(std::begin(names), std::end(names));
+    return names;
+  };
+
+  bam_in in(fn);
+  bam_header in_hdr(in);
+  const std::vector<bam_shard> regions = {{0, 0, 100},
+                                          {0, 49990, 50010},
+                                          {0, 1000000, 1000500},
+                                          {0, 1999000, 2000000},
+                                          {1, 0, 100000}};
+  for (const auto &g : regions) {
+    auto itr = in.query(g.tid, g.beg, g.end);
+    if (CHECK(itr)) CHECK(names_of(itr) == overlapping(g.tid, g.beg, g.end));
+  }
+  auto itr = in.query(in_hdr, "c0:1001-2000");
+  if (CHECK(itr)) CHECK(names_of(itr) == overlapping(0, 1000, 2000));
+  CHECK(!in.query(in_hdr, "c9:1-10"));
+  {
+    auto by_read = in.query(0, 0, 3000);
+    size_t n = 0;
+    for (bam_rec r; by_read.read(r);) ++n;
+    CHECK(n == overlapping(0, 0, 3000).size());
+  }
+
+  const auto n_starting = [&](const bam_shard &s) {
+    size_t n = 0;
+    for (const auto &x : starts)
+      n += x.first == s.tid && x.second >= s.beg && x.second < s.end;
+    return n;
+  };
+  for (const size_t n_shards : {1, 4, 16}) {
+    const auto shards = make_shards(in, in_hdr, n_shards);
+    // the shards tile every target in order
+    bool tiled = !shards.empty() && shards.front().beg == 0;
+    for (size_t i = 1; tiled && i < shards.size(); ++i) {
+      const bam_shard &a = shards[i - 1], &b = shards[i];
+      if (a.tid == b.tid)
+        tiled = a.end == b.beg && b.beg < b.end;
+      else
+        tiled = b.tid == a.tid + 1 && a.end == in_hdr.length(a.tid) &&
+                b.beg == 0;
+    }
+    CHECK(tiled && shards.back().tid == 1 &&
+          shards.back().end == in_hdr.length(1));
+    size_t most = 0;
+    for (const auto &s : shards) most = std::max(most, n_starting(s));
+    if (n_shards == 4) CHECK(most <= 2 * starts.size() / n_shards);
+  }
+
+  const auto shards = make_shards(in, in_hdr, 8);
+  const auto counts =
+    process_shards(fn, shards, 3,
+                   [](bam_header &, const bam_shard &s, bam_itr &itr) {
+                     size_t n = 0;
+                     for (auto &r : itr) n += r.b->core.pos >= s.beg;
+                     return n;
+                   });
+  size_t total = 0, n_bad = 0;
+  for (size_t i = 0; i < shards.size() && i < counts.size(); ++i) {
+    total += counts[i];
+    n_bad += counts[i] != n_starting(shards[i]);
+  }
+  CHECK(counts.size() == shards.size() && n_bad == 0);
+  CHECK(total == starts.size());
+  bool threw = false;
+  try {
+    process_shards(fn, shards, 3,
+                   [](bam_header &, const bam_shard &s, bam_itr &) -> int {
+                     if (s.beg > 0) throw std::runtime_error("shard");
+                     return 0;
+                   });
+  }
+  catch (const std::runtime_error &) {
+    threw = true;
+  }
+  CHECK(threw);
+}
+
+auto
+test_lines(tmp_dir &tmp) -> void {
+  std::mt19937 rng(8);
+  std::vector<std::string> expected;
+  for (size_t i = 0; i < 3000; ++i)
+    expected.push_back(random_bases(rng, rng() % 200, "ACGT\t "));
+  expected[1000].clear();
+  expected[1500] = random_bases(rng, 150000, "ACGT");  // spans blocks
+  expected.push_back("last");  // written without a newline
+  const std::string fn = tmp.file("lines.txt.gz");
+  {
+    bgzf_file out(fn, "w");
+    for (size_t i = 0; i + 1 < expected.size(); ++i)
+      CHECK(out.write(expected[i] + "\n"));
+    CHECK(out.write(expected.back()));
+  }
+
+  std::vector<std::string> got;
+  bgzf_file in(fn, "r");
+  for (std::string_view line; getline(in, line);) got.emplace_back(line);
+  CHECK(got == expected);
+
+  got.clear();
+  bgzf_file blocks(fn, "r");
+  bgzf_line_reader reader(blocks);
+  std::vector<std::string_view> lines;
+  size_t n_reads = 0;
+  for (; reader.read(lines); ++n_reads)
+    for (const auto l : lines) got.emplace_back(l);
+  CHECK(got == expected);
+  CHECK(n_reads > 1);
+}
+
+// ---- threads ----
+
+auto
+test_writer_queue(tmp_dir &tmp) -> void {
+  bam_header hdr;
+  init_header(hdr, "@SQ\tSN:c0\tLN:1000\n");
+  const auto batch = [](const uint64_t seq) {
+    std::vector<bam_rec> b;
+    for (size_t i = 0; i < 5; ++i)
+      b.push_back(make_rec("w" + std::to_string(seq) + "_" + std::to_string(i),
+                           BAM_FUNMAP, -1, -1, "", "ACGT"));
+    return b;
+  };
+  const auto names_in = [](const std::string &fn) {
+    std::vector<std::string> names;
+    bam_in in(fn);
+    bam_header in_hdr(in);
+    for (bam_rec r; in.read(in_hdr, r);) names.emplace_back(r.qname());
+    return names;
+  };
+
+  // batches arrive from several threads in any order, and are written in
+  // the order of their numbers
+  const uint64_t n_batches = 200;
+  const std::string fn = tmp.file("queue.bam");
+  {
+    bam_out out(fn, true);
+    CHECK(out.write(hdr));
+    bam_writer_queue queue(out, hdr, 8);
+    std::atomic<uint64_t> next{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+      threads.emplace_back([&] {
+        for (uint64_t s = next++; s < n_batches; s = next++)
+          queue.push(s, batch(s));
+      });
+    for (auto &t : threads) t.join();
+    CHECK(queue.finish());
+  }
+  std::vector<std::string> expected;
+  for (uint64_t s = 0; s < n_batches; ++s)
+    for (const auto &r : batch(s)) expected.emplace_back(r.qname());
+  CHECK(names_in(fn) == expected);
+
+  // a batch number that never arrives: later batches are not written,
+  // finish() fails and a producer waiting for room gets false
+  const std::string gap_fn = tmp.file("gap.bam");
+  {
+    bam_out out(gap_fn, true);
+    CHECK(out.write(hdr));
+    bam_writer_queue queue(out, hdr, 2);
+    CHECK(queue.push(0, batch(0)));
+    CHECK(queue.push(2, batch(2)));
+    bool pushed = true;
+    std::thread late([&] { pushed = queue.push(3, batch(3)); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(!queue.finish());
+    late.join();
+    CHECK(!pushed);
+  }
+  expected.resize(5);
+  CHECK(names_in(gap_fn) == expected);
+}
+
+auto
+test_tpool() -> void {
+  bam_tpool pool(4);
+  std::atomic<int> sum{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t)  // dispatch from several threads at once
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 25; ++i) {
+        auto x = std::make_unique<int>(25 * t + i);  // a move-only task
+        pool.dispatch([&sum, x = std::move(x)] { sum += *x; });
+      }
+    });
+  for (auto &t : threads) t.join();
+  pool.wait();
+  CHECK(sum == 4950);
+  const auto stats = pool.stats();
+  CHECK(stats.n_threads == 4);
+  CHECK(stats.queued == 100 && stats.completed == 100);
+
+  // wait() rethrows the first exception from a task, and only once
+  for (int i = 0; i < 10; ++i)
+    pool.dispatch([i] {
+      if (i % 3 == 0) throw std::runtime_error("task " + std::to_string(i));
+    });
+  bool threw = false;
+  try {
+    pool.wait();
+  }
+  catch (const std::runtime_error &) {
+    threw = true;
+  }
+  CHECK(threw);
+  threw = false;
+  try {
+    pool.wait();
+  }
+  catch (...) {
+    threw = true;
+  }
+  CHECK(!threw);
+  CHECK(pool.stats().completed == 110);
+}
+
+}  // namespace
+
+auto
+main() -> int {
+  try {
+    tmp_dir tmp;
+    test_decode_seq();
+    test_revcomp();
+    test_prefix_sum();
+    test_count_cpg_block();
+    test_coverage(tmp);
+    test_pileup(tmp);
+    test_merge_mates();
+    test_sort_bam(tmp);
+    test_merger_stream(tmp);
+    test_header_lookup();
+    test_read_paths(tmp);
+    test_index_and_shards(tmp);
+    test_lines(tmp);
+    test_writer_queue(tmp);
+    test_tpool();
+  }
+  catch (const std::exception &e) {
+    std::fprintf(stderr, "error: %s\n", e.what());
+    return EXIT_FAILURE;
+  }
+  if (n_failed > 0) std::fprintf(stderr, "%zu checks failed\n", n_failed);
+  return n_failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}